@@ -0,0 +1,55 @@
+#ifndef _ALLOCATION_STATS_H_
+#define _ALLOCATION_STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace Sibelia
+{
+	//Calls and time spent in the global allocator. They are only counted in builds with
+	//_ALLOCATION_STATS_ defined, where sibeliaz.cpp replaces operator new and delete
+	class AllocationStats
+	{
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		AllocationStats() : calls(Calls().load()), nanoseconds(Nanoseconds().load())
+		{
+
+		}
+
+		//Counts taken since the snapshot was made
+		AllocationStats Since(const AllocationStats & start) const
+		{
+			AllocationStats ret;
+			ret.calls = calls - start.calls;
+			ret.nanoseconds = nanoseconds - start.nanoseconds;
+			return ret;
+		}
+
+		static void Add(Clock::time_point start)
+		{
+			Calls().fetch_add(1, std::memory_order_relaxed);
+			Nanoseconds().fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count(), std::memory_order_relaxed);
+		}
+
+		uint64_t calls;
+		uint64_t nanoseconds;
+
+	private:
+		static std::atomic<uint64_t> & Calls()
+		{
+			static std::atomic<uint64_t> calls(0);
+			return calls;
+		}
+
+		static std::atomic<uint64_t> & Nanoseconds()
+		{
+			static std::atomic<uint64_t> nanoseconds(0);
+			return nanoseconds;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <new>
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+namespace Sibelia
+{
+	//Monotonic memory of one worker thread. An allocation bumps a pointer through a list of
+	//chunks and is never freed on its own, Release drops all of them at once. The chunks are
+	//kept, so a thread stops calling the global allocator once they fit its largest seed
+	class Arena
+	{
+	public:
+		Arena() : current_(0), used_(0)
+		{
+
+		}
+
+		~Arena()
+		{
+			for (size_t i = 0; i < chunk_.size(); i++)
+			{
+				::operator delete(chunk_[i].data);
+			}
+		}
+
+		void * Allocate(size_t bytes, size_t alignment)
+		{
+			for (;; current_++, used_ = 0)
+			{
+				if (current_ == chunk_.size())
+				{
+					size_t size = std::max(bytes + alignment, chunk_.empty() ? MIN_CHUNK_SIZE : chunk_.back().size * 2);
+					chunk_.push_back(Chunk(static_cast<char*>(::operator new(size)), size));
+				}
+
+				size_t start = (used_ + alignment - 1) / alignment * alignment;
+				if (start + bytes <= chunk_[current_].size)
+				{
+					used_ = start + bytes;
+					return chunk_[current_].data + start;
+				}
+			}
+		}
+
+		//Everything allocated before is invalid afterwards
+		void Release()
+		{
+			current_ = used_ = 0;
+		}
+
+	private:
+		Arena(const Arena &);
+		Arena & operator = (const Arena &);
+
+		static const size_t MIN_CHUNK_SIZE = size_t(1) << 16;
+
+		struct Chunk
+		{
+			char * data;
+			size_t size;
+			Chunk(char * data, size_t size) : data(data), size(size)
+			{
+
+			}
+		};
+
+		size_t current_;
+		size_t used_;
+		std::vector<Chunk> chunk_;
+	};
+
+	//Standard allocator on top of an arena, deallocation is left to Arena::Release. Without
+	//an arena it falls back to the global allocator
+	template<class T>
+	class ArenaAllocator
+	{
+	public:
+		typedef T value_type;
+
+		ArenaAllocator(Arena * arena = 0) : arena_(arena)
+		{
+
+		}
+
+		template<class U>
+		ArenaAllocator(const ArenaAllocator<U> & other) : arena_(other.GetArena())
+		{
+
+		}
+
+		T * allocate(size_t n)
+		{
+			if (arena_ != 0)
+			{
+				return static_cast<T*>(arena_->Allocate(n * sizeof(T), alignof(T)));
+			}
+
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		}
+
+		void deallocate(T * p, size_t)
+		{
+			if (arena_ == 0)
+			{
+				::operator delete(p);
+			}
+		}
+
+		Arena * GetArena() const
+		{
+			return arena_;
+		}
+
+	private:
+		Arena * arena_;
+	};
+
+	template<class T, class U>
+	bool operator == (const ArenaAllocator<T> & a, const ArenaAllocator<U> & b)
+	{
+		return a.GetArena() == b.GetArena();
+	}
+
+	template<class T, class U>
+	bool operator != (const ArenaAllocator<T> & a, const ArenaAllocator<U> & b)
+	{
+		return a.GetArena() != b.GetArena();
+	}
+}
+
+#endif
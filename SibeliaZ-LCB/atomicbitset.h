@@ -0,0 +1,92 @@
+#ifndef _ATOMIC_BITSET_H_
+#define _ATOMIC_BITSET_H_
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+
+namespace Sibelia
+{
+	//Fixed-size bitset that can be tested and set from many threads at once
+	class AtomicBitset
+	{
+	public:
+		AtomicBitset() : size_(0), word_(0)
+		{
+
+		}
+
+		void Init(size_t size)
+		{
+			size_ = size;
+			buffer_.reset(new std::atomic<uint64_t>[GetWordsNumber()]);
+			word_ = buffer_.get();
+			for (size_t i = 0; i < GetWordsNumber(); i++)
+			{
+				word_[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		//Uses the words at the given address, they must be cleared and outlive the bitset
+		void Place(std::atomic<uint64_t> * word, size_t size)
+		{
+			size_ = size;
+			buffer_.reset();
+			word_ = word;
+		}
+
+		//Bytes of the heap taken, placed words are not counted
+		size_t GetMemoryUsage() const
+		{
+			return buffer_ ? GetWordsNumber() * sizeof(uint64_t) : 0;
+		}
+
+		size_t GetSize() const
+		{
+			return size_;
+		}
+
+		size_t GetWordsNumber() const
+		{
+			return (size_ + BITS_PER_WORD - 1) / BITS_PER_WORD;
+		}
+
+		uint64_t GetWord(size_t word) const
+		{
+			return word_[word].load(std::memory_order_acquire);
+		}
+
+		bool Test(size_t bit) const
+		{
+			return (GetWord(bit / BITS_PER_WORD) >> (bit % BITS_PER_WORD)) & 1;
+		}
+
+		void Set(size_t bit)
+		{
+			word_[bit / BITS_PER_WORD].fetch_or(uint64_t(1) << (bit % BITS_PER_WORD), std::memory_order_release);
+		}
+
+		//Sets the bits [begin, end) with one atomic operation per word
+		void SetRange(size_t begin, size_t end)
+		{
+			while (begin < end)
+			{
+				size_t word = begin / BITS_PER_WORD;
+				size_t last = std::min(end, (word + 1) * BITS_PER_WORD);
+				size_t length = last - begin;
+				uint64_t mask = (length == BITS_PER_WORD ? ~uint64_t(0) : ((uint64_t(1) << length) - 1)) << (begin % BITS_PER_WORD);
+				word_[word].fetch_or(mask, std::memory_order_release);
+				begin = last;
+			}
+		}
+
+	private:
+		static const size_t BITS_PER_WORD = 64;
+		size_t size_;
+		std::atomic<uint64_t> * word_;
+		std::unique_ptr<std::atomic<uint64_t>[]> buffer_;
+	};
+}
+
+#endif
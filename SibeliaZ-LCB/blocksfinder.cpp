@@ -25,7 +25,6 @@ namespace Sibelia
 		}
 	}
 
-	JunctionStorage * JunctionStorage::this_;
 	extern const std::string VERSION = "1.0.0";
 
 	bool compareById(const BlockInstance & a, const BlockInstance & b)
@@ -149,7 +148,7 @@ namespace Sibelia
 		size_t totalSize = 0;
 		for (int64_t i = 0; i < storage_.GetChrNumber(); i++)
 		{
-			totalSize += storage_.GetChrSequence(i).size();
+			totalSize += storage_.GetChrLength(i);
 		}
 
 		size_t totalBlockLength = 0;
@@ -184,7 +183,7 @@ namespace Sibelia
 		size_t totalSize = 0;
 		for (int64_t i = 0; i < storage_.GetChrNumber(); i++)
 		{
-			totalSize += storage_.GetChrSequence(i).size();
+			totalSize += storage_.GetChrLength(i);
 		}
 
 		out << std::endl;
@@ -218,7 +217,7 @@ namespace Sibelia
 			out << double(total) / totalSize * 100 << '%';
 			for (int64_t i = 0; i < storage_.GetChrNumber(); i++)
 			{
-				out << '\t' << double(coverage[i]) / storage_.GetChrSequence(i).size() * 100 << '%';
+				out << '\t' << double(coverage[i]) / storage_.GetChrLength(i) * 100 << '%';
 			}
 
 			out << std::endl;
@@ -350,7 +349,7 @@ namespace Sibelia
 		out << "Seq_id\tSize\tDescription" << std::endl;
 		for (int64_t i = 0; i < storage_.GetChrNumber(); i++)
 		{
-			out << i + 1 << '\t' << storage_.GetChrSequence(i).size() << '\t' << storage_.GetChrDescription(i) << std::endl;
+			out << i + 1 << '\t' << storage_.GetChrLength(i) << '\t' << storage_.GetChrDescription(i) << std::endl;
 		}
 
 		out << DELIMITER << std::endl;
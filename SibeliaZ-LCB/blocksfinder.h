@@ -8,6 +8,7 @@
 #include <list>
 #include <ctime>
 #include <queue>
+#include <random>
 #include <iterator>
 #include <cassert>
 #include <numeric>
@@ -16,7 +17,9 @@
 #include <functional>
 #include <unordered_map>
 
+#include <tbb/tick_count.h>
 #include <tbb/parallel_for.h>
+#include <tbb/enumerable_thread_specific.h>
 
 #include "path.h"
 
@@ -184,26 +187,73 @@ namespace Sibelia
 		BlocksFinder(JunctionStorage & storage, size_t k) : storage_(storage), k_(k)
 		{
 			progressCount_ = 50;
+			seedsNumber_ = 0;
 			scoreFullChains_ = true;			
 		}
 
+		typedef std::vector<Edge, ArenaAllocator<Edge> > EdgeList;
+		typedef std::vector<Path::InstanceSet::const_iterator, ArenaAllocator<Path::InstanceSet::const_iterator> > LockList;
+
+		//Scratch of one worker thread. It is created for the first range the thread gets and
+		//reused by the following ones, the vote counters are left zeroed after every vertex.
+		//The bodies and instance lists of both paths, the best edges and the locked instances
+		//are taken from the arena of the thread, which is released after every seed
+		struct WorkerContext
+		{
+		public:
+			WorkerContext(const BlocksFinder & finder) :
+				count(finder.storage_.GetVerticesNumber() * 2 + 1, 0),
+				bestEdge(ArenaAllocator<Edge>(&arena)),
+				lockInstance(ArenaAllocator<Path::InstanceSet::const_iterator>(&arena)),
+				finalizer(finder.storage_, finder.maxBranchSize_, finder.minBlockSize_, finder.minBlockSize_, finder.maxFlankingSize_, &arena),
+				currentPath(finder.storage_, finder.maxBranchSize_, finder.minBlockSize_, finder.minBlockSize_, finder.maxFlankingSize_, &arena)
+			{
+
+			}
+
+			void ReleaseArena()
+			{
+				finalizer.ClearBuffers();
+				currentPath.ClearBuffers();
+				EdgeList(bestEdge.get_allocator()).swap(bestEdge);
+				LockList(lockInstance.get_allocator()).swap(lockInstance);
+				arena.Release();
+			}
+
+			Arena arena;
+			std::vector<size_t> data;
+			std::vector<uint32_t> count;
+			EdgeList bestEdge;
+			LockList lockInstance;
+			Path finalizer;
+			Path currentPath;
+		};
+
+		typedef tbb::enumerable_thread_specific<std::unique_ptr<WorkerContext> > WorkerContexts;
+
 		struct ProcessVertex
 		{
 		public:
 			BlocksFinder & finder;
 			std::vector<int64_t> & shuffle;
+			WorkerContexts & contexts;
 
-			ProcessVertex(BlocksFinder & finder, std::vector<int64_t> & shuffle) : finder(finder), shuffle(shuffle)
+			ProcessVertex(BlocksFinder & finder, std::vector<int64_t> & shuffle, WorkerContexts & contexts) : finder(finder), shuffle(shuffle), contexts(contexts)
 			{
 			}
 
 			void operator()(tbb::blocked_range<size_t> & range) const
 			{
-				std::vector<size_t> data;
-				std::vector<uint32_t> count(finder.storage_.GetVerticesNumber() * 2 + 1, 0);
-				std::pair<int64_t, std::vector<Path::Instance> > goodInstance;
-				Path finalizer(finder.storage_, finder.maxBranchSize_, finder.minBlockSize_, finder.minBlockSize_, finder.maxFlankingSize_);
-				Path currentPath(finder.storage_, finder.maxBranchSize_, finder.minBlockSize_, finder.minBlockSize_, finder.maxFlankingSize_);
+				std::unique_ptr<WorkerContext> & context = contexts.local();
+				if (!context)
+				{
+					context.reset(new WorkerContext(finder));
+				}
+
+				std::vector<size_t> & data = context->data;
+				std::vector<uint32_t> & count = context->count;
+				Path & finalizer = context->finalizer;
+				Path & currentPath = context->currentPath;
 				for (size_t i = range.begin(); i != range.end(); i++)
 				{
 					if (finder.count_++ % finder.progressPortion_ == 0)
@@ -258,7 +308,8 @@ namespace Sibelia
 						}
 
 						{
-							std::vector<Edge> bestEdge;
+							EdgeList & bestEdge = context->bestEdge;
+							bestEdge.clear();
 							for (size_t i = 0; i < bestRightSize - 1; i++)
 							{
 								bestEdge.push_back(currentPath.RightPoint(i).GetEdge());
@@ -303,7 +354,7 @@ namespace Sibelia
 								currentPath.DumpInstances(std::cerr);
 							}
 #endif
-							if (!finder.TryFinalizeBlock(currentPath, finalizer, bestRightSize, bestLeftSize))
+							if (!finder.TryFinalizeBlock(currentPath, finalizer, bestRightSize, bestLeftSize, context->lockInstance))
 							{
 								explore = false;
 							}
@@ -315,6 +366,8 @@ namespace Sibelia
 
 						currentPath.Clear();
 					}
+
+					context->ReleaseArena();
 				}
 			}
 		};
@@ -335,6 +388,56 @@ namespace Sibelia
 			}
 		}
 
+		size_t GetSeedsNumber() const
+		{
+			return seedsNumber_;
+		}
+
+		//Number of seeds and wall-clock seconds of each batch of the last FindBlocks run
+		const std::vector<std::pair<size_t, double> > & GetBatchTimes() const
+		{
+			return batchTime_;
+		}
+
+		//Bytes needed by FindBlocks: the block assignment of every junction and, for each
+		//thread, the vertex counters and the distance maps of its two Path contexts
+		uint64_t GetMemoryUsage(int64_t threads) const
+		{
+			uint64_t occurrences = 0;
+			for (int64_t chr = 0; chr < storage_.GetChrNumber(); chr++)
+			{
+				occurrences += storage_.GetChrVerticesCount(chr);
+			}
+
+			return EstimateMemory(storage_.GetVerticesNumber(), occurrences, threads);
+		}
+
+		static uint64_t EstimateMemory(uint64_t vertices, uint64_t occurrences, int64_t threads)
+		{
+			return occurrences * sizeof(Assignment) + threads * GetContextMemory(vertices);
+		}
+
+		//Scratch of one thread: the vertex counters. The distance maps of the two Path contexts
+		//follow the path length and start at a few KB
+		static uint64_t GetContextMemory(uint64_t vertices)
+		{
+			return (vertices * 2 + 1) * sizeof(uint32_t) + 2 * DistanceKeeper::GetInitialMemory();
+		}
+
+		//Returns the largest number of threads, up to the requested one, whose contexts fit into the budget
+		int64_t FitMemoryBudget(uint64_t budget, int64_t threads) const
+		{
+			for (; threads > 0 && GetMemoryUsage(threads) > budget; threads--);
+			if (threads == 0)
+			{
+				std::stringstream ss;
+				ss << "the memory budget is too small, looking for blocks needs about " << (GetMemoryUsage(1) >> 20) << " MB more than the graph";
+				throw std::runtime_error(ss.str());
+			}
+
+			return threads;
+		}
+
 		void FindBlocks(int64_t minBlockSize, int64_t maxBranchSize, int64_t maxFlankingSize, int64_t lookingDepth, int64_t sampleSize, int64_t threads, const std::string & debugOut)
 		{
 			blocksFound_ = 0;
@@ -343,16 +446,20 @@ namespace Sibelia
 			minBlockSize_ = minBlockSize;
 			maxBranchSize_ = maxBranchSize;
 			maxFlankingSize_ = maxFlankingSize;
-			blockId_.resize(storage_.GetChrNumber());
+			size_t positions = 0;
 			for (int64_t i = 0; i < storage_.GetChrNumber(); i++)
 			{
-				blockId_[i].resize(storage_.GetChrVerticesCount(i));
+				positions += storage_.GetChrVerticesCount(i);
 			}
 
+			Assignment unassigned;
+			unassigned.block = unassigned.instance = 0;
+			blockId_.Assign(positions, unassigned);
+
 			std::vector<int64_t> shuffle;
 			for (int64_t v = -storage_.GetVerticesNumber() + 1; v < storage_.GetVerticesNumber(); v++)
 			{
-				for (JunctionStorage::JunctionIterator it(v); it.Valid(); ++it)
+				for (JunctionStorage::JunctionIterator it(storage_, v); it.Valid(); ++it)
 				{
 					if (it.IsPositiveStrand())
 					{
@@ -362,15 +469,63 @@ namespace Sibelia
 				}
 			}
 
+			//Vertices are numbered in the order of their first occurrences in the genomes. With an
+			//out-of-core storage the seeds are shuffled only within batches of consecutive ids
+			//that are processed one after another, so each batch works on a few chromosomes
+			std::vector<size_t> batch(1, 0);
+			if (storage_.IsOutOfCore())
+			{
+				std::sort(shuffle.begin(), shuffle.end(), [](int64_t a, int64_t b) { return std::make_pair(abs(a), a) < std::make_pair(abs(b), b); });
+				for (size_t end = SEED_BATCH_SIZE; end < shuffle.size(); end += SEED_BATCH_SIZE)
+				{
+					batch.push_back(end);
+				}
+			}
+
+			batch.push_back(shuffle.size());
 			using namespace std::placeholders;
-			std::random_shuffle(shuffle.begin(), shuffle.end());
+			std::mt19937 generator;
+			for (size_t b = 0; b + 1 < batch.size(); b++)
+			{
+				std::shuffle(shuffle.begin() + batch[b], shuffle.begin() + batch[b + 1], generator);
+			}
+
+			//A calibration run processes only a prefix of the shuffled seeds. It is split into
+			//batches timed separately, each batch is cut into one range per thread
+			seedsNumber_ = shuffle.size();
+			if (sampleSize > 0)
+			{
+				size_t sample = min(shuffle.size(), size_t(sampleSize));
+				batch.assign(1, 0);
+				for (size_t i = 1; i <= SAMPLE_BATCHES; i++)
+				{
+					batch.push_back(sample * i / SAMPLE_BATCHES);
+				}
+			}
 
 			time_t mark = time(0);
 			count_ = 0;
 			std::cout << '[' << std::flush;
-			progressPortion_ = shuffle.size() / progressCount_;
+			progressPortion_ = max(size_t(1), batch.back() / progressCount_);
+			batchTime_.clear();
+			WorkerContexts contexts;
 			tbb::task_scheduler_init init(static_cast<int>(threads));
-			tbb::parallel_for(tbb::blocked_range<size_t>(0, shuffle.size()), ProcessVertex(*this, shuffle));
+			for (size_t b = 0; b + 1 < batch.size(); b++)
+			{
+				tbb::tick_count start = tbb::tick_count::now();
+				if (sampleSize > 0)
+				{
+					size_t grain = max(size_t(1), (batch[b + 1] - batch[b]) / threads);
+					tbb::parallel_for(tbb::blocked_range<size_t>(batch[b], batch[b + 1], grain), ProcessVertex(*this, shuffle, contexts), tbb::simple_partitioner());
+				}
+				else
+				{
+					tbb::parallel_for(tbb::blocked_range<size_t>(batch[b], batch[b + 1]), ProcessVertex(*this, shuffle, contexts));
+				}
+
+				batchTime_.push_back(std::make_pair(batch[b + 1] - batch[b], (tbb::tick_count::now() - start).seconds()));
+			}
+
 			std::cout << ']' << std::endl;
 			//std::cout << "Time: " << time(0) - mark << std::endl;
 		}
@@ -378,6 +533,7 @@ namespace Sibelia
 		
 		void ListBlocksSequences(const BlockList & block, const std::string & directory) const
 		{
+			std::string buffer;
 			std::vector<IndexPair> group;
 			BlockList blockList = block;
 			GroupBy(blockList, compareById, std::back_inserter(group));
@@ -391,22 +547,22 @@ namespace Sibelia
 				{
 					size_t length = blockList[block].GetLength();
 					size_t chr = blockList[block].GetChrId();
-					size_t chrSize = storage_.GetChrSequence(chr).size();
+					size_t chrSize = storage_.GetChrLength(chr);
 					out << ">" << blockList[block].GetBlockId() << "_" << block - it->first << " ";
 					out << storage_.GetChrDescription(chr) << ";";
 					if (blockList[block].GetSignedBlockId() > 0)
 					{
 						out << blockList[block].GetStart() << ";" << length << ";" << "+;" << chrSize << std::endl;
-						OutputLines(storage_.GetChrSequence(chr).begin() + blockList[block].GetStart(), length, out);
+						storage_.GetChrSubstring(chr, blockList[block].GetStart(), length, false, buffer);
 					}
 					else
 					{
 						size_t start = chrSize - blockList[block].GetEnd();
 						out << start << ";" << length << ";" << "-;" << chrSize << std::endl;
-						std::string::const_reverse_iterator it(storage_.GetChrSequence(chr).begin() + blockList[block].GetEnd());
-						OutputLines(CFancyIterator(it, TwoPaCo::DnaChar::ReverseChar, ' '), length, out);
+						storage_.GetChrSubstring(chr, blockList[block].GetEnd() - length, length, true, buffer);
 					}
 
+					OutputLines(buffer.begin(), length, out);
 					out << std::endl;
 				}
 			}
@@ -419,18 +575,19 @@ namespace Sibelia
 			std::vector<std::vector<bool> > covered(storage_.GetChrNumber());
 			for (size_t i = 0; i < covered.size(); i++)
 			{
-				covered[i].assign(storage_.GetChrSequence(i).size(), false);
+				covered[i].assign(storage_.GetChrLength(i), false);
 			}
 
-			for (size_t chr = 0; chr < blockId_.size(); chr++)
+			const Assignment * blockId = blockId_.GetData();
+			for (int64_t chr = 0; chr < storage_.GetChrNumber(); blockId += storage_.GetChrVerticesCount(chr++))
 			{
-				for (size_t i = 0; i < blockId_[chr].size();)
+				for (int64_t i = 0; i < storage_.GetChrVerticesCount(chr);)
 				{
 					if (storage_.GetIterator(chr, i).IsUsed())
 					{
-						int64_t bid = blockId_[chr][i].block;
-						size_t j = i;
-						for (; j < blockId_[chr].size() && blockId_[chr][i] == blockId_[chr][j]; j++);
+						int64_t bid = blockId[i].block;
+						int64_t j = i;
+						for (; j < storage_.GetChrVerticesCount(chr) && blockId[i] == blockId[j]; j++);
 						j--;
 						int64_t start = storage_.GetIterator(chr, i, bid > 0).GetPosition() + (bid > 0 ? 0 : -k_);
 						int64_t end = storage_.GetIterator(chr, j, bid > 0).GetPosition() + (bid > 0 ? k_ : 0);
@@ -455,6 +612,7 @@ namespace Sibelia
 			ListBlocksIndicesGFF(instance, outDir + "/" + "blocks_coords.gff");
 			if (genSeq)
 			{
+				storage_.LoadSequences();
 				CreateOutDirectory(blocksDir);
 				ListBlocksSequences(instance, blocksDir);
 			}
@@ -493,7 +651,7 @@ namespace Sibelia
 		template<class T>
 		void DumpVertex(int64_t id, std::ostream & out, T & visit, int64_t cnt = 5) const
 		{
-			for (auto kt = JunctionStorage::JunctionIterator(id); kt.Valid(); ++kt)
+			for (auto kt = JunctionStorage::JunctionIterator(storage_, id); kt.Valid(); ++kt)
 			{
 				auto jt = kt.SequentialIterator();
 				for (int64_t i = 0; i < cnt; i++)
@@ -513,7 +671,7 @@ namespace Sibelia
 				}
 			}
 
-			for (auto kt = JunctionStorage::JunctionIterator(id); kt.Valid(); ++kt)
+			for (auto kt = JunctionStorage::JunctionIterator(storage_, id); kt.Valid(); ++kt)
 			{
 				auto it = kt.SequentialIterator();
 				for (int64_t i = 0; i < cnt; i++)
@@ -534,10 +692,10 @@ namespace Sibelia
 			}
 		}
 
-		bool TryFinalizeBlock(const Path & currentPath, Path & finalizer, size_t bestRightSize, size_t bestLeftSize)
+		bool TryFinalizeBlock(const Path & currentPath, Path & finalizer, size_t bestRightSize, size_t bestLeftSize, LockList & lockInstance)
 		{
 			bool ret = false;
-			std::vector<Path::InstanceSet::const_iterator> lockInstance;
+			lockInstance.clear();
 			for (auto it : currentPath.GoodInstancesList())
 			{
 				lockInstance.push_back(it);
@@ -545,7 +703,7 @@ namespace Sibelia
 			
 			std::sort(lockInstance.begin(), lockInstance.end(), Path::CmpInstance);
 			{
-				std::pair<size_t, size_t> idx(SIZE_MAX, SIZE_MAX);
+				size_t idx = SIZE_MAX;
 				for (auto & instance : lockInstance)
 				{
 					if (instance->Front().IsPositiveStrand())
@@ -571,14 +729,22 @@ namespace Sibelia
 				{
 					if (finalizer.IsGoodInstance(*jt))
 					{
+						if (jt->Front().IsPositiveStrand())
+						{
+							storage_.MarkRangeUsed(jt->Front(), jt->Back());
+						}
+						else
+						{
+							storage_.MarkRangeUsed(jt->Back().Reverse(), jt->Front().Reverse());
+						}
+
 						auto it = jt->Front();
 						do
 						{
-							it.MarkUsed();							
 							int64_t idx = it.GetIndex();
 							int64_t maxidx = storage_.GetChrVerticesCount(it.GetChrId());
-							blockId_[it.GetChrId()][it.GetIndex()].block = int32_t(it.IsPositiveStrand() ? +currentBlock : -currentBlock);
-							blockId_[it.GetChrId()][it.GetIndex()].instance = int32_t(instanceCount);
+							blockId_[it.GetGlobalIndex()].block = int32_t(it.IsPositiveStrand() ? +currentBlock : -currentBlock);
+							blockId_[it.GetGlobalIndex()].instance = int32_t(instanceCount);
 
 						} while (it++ != jt->Back());
 
@@ -588,7 +754,7 @@ namespace Sibelia
 			}
 				
 			finalizer.Clear();
-			std::pair<size_t, size_t> idx(SIZE_MAX, SIZE_MAX);
+			size_t idx = SIZE_MAX;
 			for (auto & instance : lockInstance)
 			{
 				if (instance->Front().IsPositiveStrand())
@@ -781,9 +947,14 @@ namespace Sibelia
 			return success;
 		}
 
+		static const size_t SEED_BATCH_SIZE = size_t(1) << 16;
+		static const size_t SAMPLE_BATCHES = 4;
+
 		int64_t k_;
 		size_t progressCount_;
 		size_t progressPortion_;
+		size_t seedsNumber_;
+		std::vector<std::pair<size_t, double> > batchTime_;
 		std::atomic<int64_t> count_;
 		std::atomic<int64_t> blocksFound_;
 		int64_t sampleSize_;
@@ -797,7 +968,7 @@ namespace Sibelia
 		tbb::mutex progressMutex_;
 		std::ofstream debugOut_;
 		std::vector<std::vector<Edge> > syntenyPath_;
-		std::vector<std::vector<Assignment> > blockId_;
+		LargeArray<Assignment> blockId_;
 #ifdef _DEBUG_OUT_
 		bool debug_;
 		std::set<int64_t> missingVertex_;
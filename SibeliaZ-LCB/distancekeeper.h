@@ -1,42 +1,111 @@
 #ifndef _DISTANCE_KEEPER_H_
 #define _DISTANCE_KEEPER_H_
 
+#include <limits>
+
 #include "junctionstorage.h"
 
 namespace Sibelia
 {
+	//Distances from the origin to the vertices of a path. A linear probing table that grows
+	//with the path. The entries are stamped with the generation they were set in, so Clear
+	//only starts a new generation
 	class DistanceKeeper
 	{
 	public:
-		DistanceKeeper(int64_t vertices) : vertices_(vertices), NOT_SET(INT_MAX)
+		DistanceKeeper() : size_(0), generation_(1)
 		{
-			distance_.assign(vertices_ * 2, NOT_SET);
+			slot_.resize(INITIAL_CAPACITY);
 		}
 
 		bool IsSet(int64_t v) const
 		{
-			return distance_[v + vertices_] != NOT_SET;
+			return slot_[Find(v)].generation == generation_;
 		}
 
-		void Set(int64_t v, int distance)
+		void Set(int64_t v, SignedOffset distance)
 		{
-			distance_[v + vertices_] = distance;
+			size_t idx = Find(v);
+			if (slot_[idx].generation != generation_)
+			{
+				if (++size_ * 2 > slot_.size())
+				{
+					Grow();
+					idx = Find(v);
+				}
+
+				slot_[idx].vertex = int32_t(v);
+				slot_[idx].generation = generation_;
+			}
+
+			slot_[idx].distance = distance;
 		}
 
-		int Get(int64_t v) const
+		SignedOffset Get(int64_t v) const
 		{
-			return distance_[v + vertices_];
+			const Slot & slot = slot_[Find(v)];
+			return slot.generation == generation_ ? slot.distance : std::numeric_limits<SignedOffset>::max();
 		}
 
-		void Unset(int64_t v)
+		void Clear()
 		{
-			distance_[v + vertices_] = NOT_SET;
+			size_ = 0;
+			if (++generation_ == 0)
+			{
+				for (size_t i = 0; i < slot_.size(); i++)
+				{
+					slot_[i].generation = 0;
+				}
+
+				generation_ = 1;
+			}
+		}
+
+		static size_t GetInitialMemory()
+		{
+			return INITIAL_CAPACITY * sizeof(Slot);
 		}
 
 	private:
-		int64_t vertices_;
-		const int NOT_SET;
-		std::vector<int> distance_;
+		static const size_t INITIAL_CAPACITY = 1 << 10;
+
+		struct Slot
+		{
+			Slot() : vertex(0), generation(0), distance(0)
+			{
+
+			}
+
+			int32_t vertex;
+			uint32_t generation;
+			SignedOffset distance;
+		};
+
+		//Slot holding the vertex or the empty slot where it would go
+		size_t Find(int64_t v) const
+		{
+			size_t mask = slot_.size() - 1;
+			size_t idx = size_t((uint64_t(uint32_t(v)) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+			for (; slot_[idx].generation == generation_ && slot_[idx].vertex != v; idx = (idx + 1) & mask);
+			return idx;
+		}
+
+		void Grow()
+		{
+			std::vector<Slot> old(slot_.size() * 2);
+			old.swap(slot_);
+			for (size_t i = 0; i < old.size(); i++)
+			{
+				if (old[i].generation == generation_)
+				{
+					slot_[Find(old[i].vertex)] = old[i];
+				}
+			}
+		}
+
+		size_t size_;
+		uint32_t generation_;
+		std::vector<Slot> slot_;
 	};
 }
 
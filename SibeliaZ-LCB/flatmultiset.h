@@ -0,0 +1,148 @@
+#ifndef _FLAT_MULTISET_H_
+#define _FLAT_MULTISET_H_
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+namespace Sibelia
+{
+	//Ordered multiset for the instances of a path. The elements are appended to a pool and
+	//never move, the order is a sorted array of pool slots. An iterator names a slot, so it
+	//stays valid through the inserts like a std::multiset one. Equal elements are kept in
+	//the order of insertion. An element may be changed through an iterator as long as its
+	//place in the order stays the same. There is no erase, the set is emptied at once
+	template<class T>
+	class FlatMultiset
+	{
+	public:
+		class iterator
+		{
+		public:
+			iterator() : set_(0), slot_(END)
+			{
+
+			}
+
+			const T & operator * () const
+			{
+				return set_->pool_[slot_];
+			}
+
+			const T * operator -> () const
+			{
+				return &set_->pool_[slot_];
+			}
+
+			iterator & operator ++ ()
+			{
+				size_t position = set_->position_[slot_] + 1;
+				slot_ = position < set_->order_.size() ? set_->order_[position] : END;
+				return *this;
+			}
+
+			iterator & operator -- ()
+			{
+				size_t position = slot_ == END ? set_->order_.size() : set_->position_[slot_];
+				slot_ = set_->order_[position - 1];
+				return *this;
+			}
+
+			bool operator == (const iterator & it) const
+			{
+				return slot_ == it.slot_;
+			}
+
+			bool operator != (const iterator & it) const
+			{
+				return slot_ != it.slot_;
+			}
+
+		private:
+			iterator(const FlatMultiset * set, uint32_t slot) : set_(set), slot_(slot)
+			{
+
+			}
+
+			const FlatMultiset * set_;
+			uint32_t slot_;
+			friend class FlatMultiset;
+		};
+
+		typedef iterator const_iterator;
+
+		iterator begin() const
+		{
+			return iterator(this, order_.empty() ? END : order_[0]);
+		}
+
+		iterator end() const
+		{
+			return iterator(this, END);
+		}
+
+		size_t size() const
+		{
+			return order_.size();
+		}
+
+		//First element greater than the value
+		iterator upper_bound(const T & value) const
+		{
+			size_t position = UpperBound(value);
+			return iterator(this, position < order_.size() ? order_[position] : END);
+		}
+
+		iterator insert(const T & value)
+		{
+			size_t position = UpperBound(value);
+			uint32_t slot = uint32_t(pool_.size());
+			pool_.push_back(value);
+			position_.push_back(uint32_t(position));
+			order_.insert(order_.begin() + position, slot);
+			for (size_t i = position + 1; i < order_.size(); i++)
+			{
+				position_[order_[i]] = uint32_t(i);
+			}
+
+			return iterator(this, slot);
+		}
+
+		//Keeps the capacity for the next path
+		void clear()
+		{
+			pool_.clear();
+			order_.clear();
+			position_.clear();
+		}
+
+	private:
+		static const uint32_t END = UINT32_MAX;
+
+		size_t UpperBound(const T & value) const
+		{
+			size_t low = 0;
+			size_t high = order_.size();
+			while (low < high)
+			{
+				size_t middle = (low + high) / 2;
+				if (value < pool_[order_[middle]])
+				{
+					high = middle;
+				}
+				else
+				{
+					low = middle + 1;
+				}
+			}
+
+			return low;
+		}
+
+		std::vector<T> pool_;
+		std::vector<uint32_t> order_;
+		std::vector<uint32_t> position_;
+	};
+}
+
+#endif
@@ -2,24 +2,47 @@
 #define _JUNCTION_STORAGE_H_
 
 #include <set>
+#include <cassert>
 #include <atomic>
 #include <string>
 #include <vector>
+#include <thread>
 #include <memory>
 #include <cstdint>
+#include <exception>
 #include <stdexcept>
+#include <cstring>
+#include <fstream>
+#include <sstream>
 #include <algorithm>
 
 #include <tbb/mutex.h>
+#include <tbb/parallel_for.h>
+#include <tbb/concurrent_queue.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_scheduler_init.h>
 
 #include <streamfastaparser.h>
 #include <junctionapi.h>
 
+#include "mappedfile.h"
+#include "largearray.h"
+#include "atomicbitset.h"
+#include "sequencestorage.h"
+
 namespace Sibelia
 {	
 	using std::min;
 	using std::max;
 
+#ifdef _LARGE_CHROMOSOMES_
+	typedef uint64_t Offset;
+	typedef int64_t SignedOffset;
+#else
+	typedef uint32_t Offset;
+	typedef int32_t SignedOffset;
+#endif
+
 	class Edge
 	{
 	public:
@@ -123,44 +146,86 @@ namespace Sibelia
 		{
 			int32_t id;
 			uint32_t chr;
-			uint32_t idx;
-			uint32_t pos;
-			char ch;
-			char revCh;
+			Offset idx;
+			Offset pos;
 
-			Vertex(const TwoPaCo::JunctionPosition & junction) : id(static_cast<int32_t>(junction.GetId())), chr(junction.GetChr()), pos(junction.GetPos())
+			Vertex(int32_t id, uint32_t chr, Offset idx, Offset pos) : id(id), chr(chr), idx(idx), pos(pos)
 			{
 
 			}
 		};
 
-		struct Position
+		//Occurrences of all vertices in the compressed sparse row layout: the occurrences
+		//of the vertex v are [begin[v], begin[v + 1]) in each of the field arrays
+		struct VertexTable
 		{
-			int32_t id;
-			uint32_t pos;
-			std::atomic<bool> used;
+			uint64_t * begin;
+			uint32_t * chr;
+			Offset * idx;
+			Offset * pos;
+			char * ch;
+			char * revCh;
+			bool * positive;
+
+			static size_t GetSize(size_t vertices, size_t occurrences)
+			{
+				size_t ret = Align((vertices + 1) * sizeof(uint64_t));
+				ret += Align(occurrences * sizeof(uint32_t));
+				ret += Align(occurrences * sizeof(Offset)) * 2;
+				ret += Align(occurrences * sizeof(char)) * 2;
+				return ret + Align(occurrences * sizeof(bool));
+			}
 
-			Position() : used(false)
+			void Place(char * data, size_t vertices, size_t occurrences)
 			{
+				begin = reinterpret_cast<uint64_t*>(data);
+				data += Align((vertices + 1) * sizeof(uint64_t));
+				chr = reinterpret_cast<uint32_t*>(data);
+				data += Align(occurrences * sizeof(uint32_t));
+				idx = reinterpret_cast<Offset*>(data);
+				data += Align(occurrences * sizeof(Offset));
+				pos = reinterpret_cast<Offset*>(data);
+				data += Align(occurrences * sizeof(Offset));
+				ch = data;
+				data += Align(occurrences * sizeof(char));
+				revCh = data;
+				data += Align(occurrences * sizeof(char));
+				positive = reinterpret_cast<bool*>(data);
+			}
 
+			static size_t Align(size_t size)
+			{
+				return (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
 			}
+		};
 
-			void Assign(const TwoPaCo::JunctionPosition & junction)
+		struct Position
+		{
+			int32_t id;
+			Offset pos;
+			void Assign(int32_t newId, Offset newPos)
 			{
-				id = static_cast<int32_t>(junction.GetId());
-				pos = junction.GetPos();
+				id = newId;
+				pos = newPos;
 			}
 		};
 
-		typedef std::vector<Vertex> VertexVector;
+		struct RawJunction
+		{
+			int32_t id;
+			Offset pos;
+		};
+
 		typedef std::vector<Position> PositionVector;
+		typedef std::vector<RawJunction> RawJunctionVector;
+		typedef std::vector<TwoPaCo::JunctionPosition> JunctionBatch;
 
 	public:
 
 		class JunctionSequentialIterator
 		{
 		public:
-			JunctionSequentialIterator() : idx_(0)
+			JunctionSequentialIterator() : storage_(0), idx_(0)
 			{
 
 			}
@@ -172,76 +237,75 @@ namespace Sibelia
 
 			int64_t GetVertexId() const
 			{
-				return IsPositiveStrand() ? JunctionStorage::this_->position_[GetChrId()][idx_].id : -JunctionStorage::this_->position_[GetChrId()][idx_].id;
+				return IsPositiveStrand() ? storage_->position_[GetChrId()][idx_].id : -storage_->position_[GetChrId()][idx_].id;
 			}
 
 			int64_t GetPosition() const
 			{
 				if (IsPositiveStrand())
 				{
-					return JunctionStorage::this_->position_[GetChrId()][idx_].pos;
+					return storage_->position_[GetChrId()][idx_].pos;
 				}
 
-				return JunctionStorage::this_->position_[GetChrId()][idx_].pos + JunctionStorage::this_->k_;
+				return storage_->position_[GetChrId()][idx_].pos + storage_->k_;
 			}
 
 			int64_t GetAbsolutePosition() const
 			{
-				return JunctionStorage::this_->position_[GetChrId()][idx_].pos;
+				return storage_->position_[GetChrId()][idx_].pos;
 			}
 
 			Edge OutgoingEdge() const
 			{
-				const Position & now = JunctionStorage::this_->position_[GetChrId()][idx_];
+				const Position & now = storage_->position_[GetChrId()][idx_];
 				if (IsPositiveStrand())
 				{
-					const Position & next = JunctionStorage::this_->position_[GetChrId()][idx_ + 1];
-					char ch = JunctionStorage::this_->sequence_[GetChrId()][now.pos + JunctionStorage::this_->k_];
-					char revCh = TwoPaCo::DnaChar::ReverseChar(JunctionStorage::this_->sequence_[GetChrId()][next.pos - 1]);
+					const Position & next = storage_->position_[GetChrId()][idx_ + 1];
+					char ch = storage_->GetFollowingChar(GetChrId(), idx_);
+					char revCh = TwoPaCo::DnaChar::ReverseChar(storage_->GetPrecedingChar(GetChrId(), idx_ + 1));
 					return Edge(now.id, next.id, ch, revCh, next.pos - now.pos, 1);
 				}
 				else
 				{
-					const Position & next = JunctionStorage::this_->position_[GetChrId()][idx_ - 1];
-					char ch = TwoPaCo::DnaChar::ReverseChar(JunctionStorage::this_->sequence_[GetChrId()][now.pos - 1]);
-					char revCh = JunctionStorage::this_->sequence_[GetChrId()][now.pos + JunctionStorage::this_->k_];
+					const Position & next = storage_->position_[GetChrId()][idx_ - 1];
+					char ch = TwoPaCo::DnaChar::ReverseChar(storage_->GetPrecedingChar(GetChrId(), idx_));
+					char revCh = storage_->GetFollowingChar(GetChrId(), idx_ - 1);
 					return Edge(-now.id, -next.id, ch, revCh, now.pos - next.pos, 1);
 				}
 			}
 
 			Edge IngoingEdge() const
 			{
-				const Position & now = JunctionStorage::this_->position_[GetChrId()][idx_];
+				const Position & now = storage_->position_[GetChrId()][idx_];
 				if (IsPositiveStrand())
 				{
-					const Position & prev = JunctionStorage::this_->position_[GetChrId()][idx_ - 1];
-					char ch = JunctionStorage::this_->sequence_[GetChrId()][prev.pos + JunctionStorage::this_->k_];
-					char revCh = TwoPaCo::DnaChar::ReverseChar(JunctionStorage::this_->sequence_[GetChrId()][now.pos - 1]);
+					const Position & prev = storage_->position_[GetChrId()][idx_ - 1];
+					char ch = storage_->GetFollowingChar(GetChrId(), idx_ - 1);
+					char revCh = TwoPaCo::DnaChar::ReverseChar(storage_->GetPrecedingChar(GetChrId(), idx_));
 					return Edge(prev.id, now.id, ch, revCh, now.pos - prev.pos, 1);
 				}
 				else
 				{
-					const Position & prev = JunctionStorage::this_->position_[GetChrId()][idx_ + 1];
-					char ch = TwoPaCo::DnaChar::ReverseChar(JunctionStorage::this_->sequence_[GetChrId()][prev.pos - 1]);
-					char revCh = JunctionStorage::this_->sequence_[GetChrId()][now.pos + JunctionStorage::this_->k_];
+					const Position & prev = storage_->position_[GetChrId()][idx_ + 1];
+					char ch = TwoPaCo::DnaChar::ReverseChar(storage_->GetPrecedingChar(GetChrId(), idx_ + 1));
+					char revCh = storage_->GetFollowingChar(GetChrId(), idx_);
 					return Edge(-prev.id, -now.id, ch, revCh, prev.pos - now.pos, 1);
 				}
 			}
 
 			JunctionSequentialIterator Reverse()
 			{
-				return JunctionSequentialIterator(GetChrId(), idx_, !IsPositiveStrand());
+				return JunctionSequentialIterator(storage_, GetChrId(), idx_, !IsPositiveStrand());
 			}
 
 			char GetChar() const
 			{
-				int64_t pos = JunctionStorage::this_->position_[GetChrId()][idx_].pos;
 				if (IsPositiveStrand())
 				{
-					return JunctionStorage::this_->sequence_[GetChrId()][pos + JunctionStorage::this_->k_];
+					return storage_->GetFollowingChar(GetChrId(), idx_);
 				}
 
-				return TwoPaCo::DnaChar::ReverseChar(JunctionStorage::this_->sequence_[GetChrId()][pos - 1]);
+				return TwoPaCo::DnaChar::ReverseChar(storage_->GetPrecedingChar(GetChrId(), idx_));
 			}
 
 			uint64_t GetIndex() const
@@ -256,7 +320,7 @@ namespace Sibelia
 					return idx_;
 				}
 
-				return JunctionStorage::this_->chrSize_[GetChrId()] - idx_ - 1;
+				return storage_->chrSize_[GetChrId()] - idx_ - 1;
 			}
 
 			uint64_t GetChrId() const
@@ -264,20 +328,24 @@ namespace Sibelia
 				return abs(chrId_) - 1;
 			}
 
+			uint64_t GetGlobalIndex() const
+			{
+				return storage_->chrStart_[GetChrId()] + idx_;
+			}
+
 			bool Valid() const
 			{
-				return idx_ >= 0 && size_t(idx_) < JunctionStorage::this_->chrSize_[GetChrId()];
+				return idx_ >= 0 && size_t(idx_) < storage_->chrSize_[GetChrId()];
 			}
 
 			bool IsUsed() const
 			{
-				bool ret = JunctionStorage::this_->position_[GetChrId()][idx_].used;
-				return ret;
+				return storage_->used_.Test(GetGlobalIndex());
 			}
 
 			void MarkUsed() const
 			{
-				JunctionStorage::this_->position_[GetChrId()][idx_].used = true;
+				storage_->used_.Set(GetGlobalIndex());
 			}
 
 			JunctionSequentialIterator& operator++ ()
@@ -366,12 +434,13 @@ namespace Sibelia
 				idx_ += IsPositiveStrand() ? -step : +step;
 			}
 
-			JunctionSequentialIterator(int64_t chrId, int64_t idx, bool isPositiveStrand) : idx_(idx), chrId_(isPositiveStrand ? chrId + 1 : -(chrId + 1))
+			JunctionSequentialIterator(const JunctionStorage * storage, int64_t chrId, int64_t idx, bool isPositiveStrand) : storage_(storage), idx_(idx), chrId_(isPositiveStrand ? chrId + 1 : -(chrId + 1))
 			{
 
 			}
 
 			friend class JunctionStorage;
+			const JunctionStorage * storage_;
 			int64_t chrId_;
 			int64_t idx_;
 		};
@@ -381,14 +450,14 @@ namespace Sibelia
 		class JunctionIterator
 		{
 		public:
-			JunctionIterator() : vid_(0)
+			JunctionIterator() : storage_(0), oidx_(0), vid_(0)
 			{
 
 			}
 
 			bool IsPositiveStrand() const
 			{
-				return JunctionStorage::this_->vertex_[abs(vid_)][iidx_].id == vid_;
+				return storage_->vertex_.positive[oidx_] == (vid_ > 0);
 			}
 
 			int64_t GetVertexId() const
@@ -398,79 +467,79 @@ namespace Sibelia
 
 			int64_t GetPosition() const
 			{
-				return JunctionStorage::this_->vertex_[abs(vid_)][iidx_].pos;
+				return storage_->vertex_.pos[oidx_];
 			}
 
 			char GetChar() const
 			{
 				if (IsPositiveStrand())
 				{
-					return JunctionStorage::this_->vertex_[abs(vid_)][iidx_].ch;
+					return storage_->vertex_.ch[oidx_];
 				}
 
-				return JunctionStorage::this_->vertex_[abs(vid_)][iidx_].revCh;
+				return storage_->vertex_.revCh[oidx_];
 			}
 
 			JunctionSequentialIterator SequentialIterator() const
 			{
-				return JunctionSequentialIterator(GetChrId(), GetIndex(), IsPositiveStrand());
+				return JunctionSequentialIterator(storage_, GetChrId(), GetIndex(), IsPositiveStrand());
 			}
 
 			uint64_t GetIndex() const
 			{
-				return JunctionStorage::this_->vertex_[abs(vid_)][iidx_].idx;
+				return storage_->vertex_.idx[oidx_];
 			}
 
 			uint64_t GetRelativeIndex() const
 			{
 				if (IsPositiveStrand())
 				{
-					return JunctionStorage::this_->vertex_[abs(vid_)][iidx_].idx;;
+					return storage_->vertex_.idx[oidx_];
 				}
 
-				return JunctionStorage::this_->chrSize_[GetChrId()] - JunctionStorage::this_->vertex_[abs(vid_)][iidx_].idx; -1;
+				return storage_->chrSize_[GetChrId()] - storage_->vertex_.idx[oidx_]; -1;
 			}
 
 			uint64_t GetChrId() const
 			{
-				return JunctionStorage::this_->vertex_[abs(vid_)][iidx_].chr;
+				return storage_->vertex_.chr[oidx_];
 			}
 
 			bool Valid() const
 			{
-				return iidx_ < JunctionStorage::this_->vertex_[abs(vid_)].size();
+				return oidx_ < storage_->vertex_.begin[abs(vid_) + 1];
 			}
 
 			size_t InstancesCount() const
 			{
-				return JunctionStorage::this_->vertex_[abs(vid_)].size();
+				return storage_->GetInstancesCount(vid_);
 			}
 
 			bool IsUsed() const
 			{
-				return JunctionStorage::this_->position_[GetChrId()][GetIndex()].used;
+				return storage_->used_.Test(storage_->chrStart_[GetChrId()] + GetIndex());
 			}
 
 			void MarkUsed() const
 			{
-				JunctionStorage::this_->position_[GetChrId()][GetIndex()].used = true;
+				storage_->used_.Set(storage_->chrStart_[GetChrId()] + GetIndex());
 			}
 
 			JunctionIterator operator + (size_t inc) const
 			{
-				return JunctionIterator(vid_, iidx_ + inc);
+				return JunctionIterator(storage_, vid_, oidx_ + inc);
 			}
 
 			JunctionIterator& operator++ ()
 			{
-				++iidx_;
+				++oidx_;
 				return *this;
 			}
 
 			JunctionIterator operator++ (int)
 			{
 				JunctionIterator ret(*this);
-				++iidx_;
+				++oidx_;
 				return ret;
 			}
 
@@ -486,7 +555,7 @@ namespace Sibelia
 
 			bool operator == (const JunctionIterator & arg) const
 			{
-				return this->vid_ == arg.vid_ && this->iidx_ == arg.iidx_;
+				return this->vid_ == arg.vid_ && this->oidx_ == arg.oidx_;
 			}
 
 			bool operator != (const JunctionIterator & arg) const
@@ -494,79 +563,169 @@ namespace Sibelia
 				return !(*this == arg);
 			}
 
-			JunctionIterator(int64_t vid) : iidx_(0), vid_(vid)
+			JunctionIterator(const JunctionStorage & storage, int64_t vid) : storage_(&storage), oidx_(storage.vertex_.begin[abs(vid)]), vid_(vid)
 			{
 			}
 
 		private:
 
-			JunctionIterator(int64_t vid, size_t iidx) : iidx_(iidx), vid_(vid)
+			JunctionIterator(const JunctionStorage * storage, int64_t vid, size_t oidx) : storage_(storage), oidx_(oidx), vid_(vid)
 			{
 			}
 
 			friend class JunctionStorage;
-			size_t iidx_;
+			const JunctionStorage * storage_;
+			size_t oidx_;
 			int64_t vid_;
 
 		};
 
+		//Drops a junction if the same vertex on the same strand occurs less than loopThreshold
+		//bp before it on the chromosome, which removes the repeated junctions of short loops and
+		//tandem repeats. The junctions of the window are kept in a ring buffer and counted by id
+		//in a linear probing table, so a junction costs O(1) expected
 		class Buffer
 		{
-		private:
-			int64_t loopThreshold_;
-			std::multiset<int64_t> inBuffer;
-			std::deque<TwoPaCo::JunctionPosition> buffer;
 		public:
+			Buffer(int64_t loopThreshold) : loopThreshold_(loopThreshold), chr_(0), head_(0), size_(0)
+			{
+				Reserve(INITIAL_WINDOW);
+			}
+
+			bool AddAndCheck(uint64_t chr, const RawJunction & junction)
+			{
+				if (loopThreshold_ <= 0)
+				{
+					return true;
+				}
+
+				if (chr != chr_)
+				{
+					while (size_ > 0)
+					{
+						PopFront();
+					}
+
+					chr_ = chr;
+				}
+
+				while (size_ > 0 && int64_t(junction.pos) - int64_t(window_[head_].pos) >= loopThreshold_)
+				{
+					PopFront();
+				}
+
+				if (size_ == window_.size())
+				{
+					Reserve(window_.size() * 2);
+				}
+
+				window_[(head_ + size_++) & (window_.size() - 1)] = junction;
+				return ++count_[Find(junction.id)].count == 1;
+			}
 
-			Buffer(int64_t loopThreshold) : loopThreshold_(loopThreshold)
+		private:
+			struct Counter
 			{
+				int32_t id;
+				uint32_t count;
+			};
+
+			static const size_t INITIAL_WINDOW = 1 << 6;
 
+			size_t Hash(int32_t id) const
+			{
+				return size_t((uint64_t(uint32_t(id)) * 0x9E3779B97F4A7C15ULL) >> 32) & (count_.size() - 1);
 			}
 
-			bool AddAndCheck(TwoPaCo::JunctionPosition junction)
+			//Slot of the id, claims an empty one if the id is not in the table
+			size_t Find(int32_t id)
 			{
-				return true;
+				size_t slot = Hash(id);
+				for (; count_[slot].count > 0 && count_[slot].id != id; slot = (slot + 1) & (count_.size() - 1));
+				count_[slot].id = id;
+				return slot;
+			}
 
-				while (buffer.size() > 0 && (buffer.front().GetChr() != junction.GetChr() || junction.GetPos() - buffer.front().GetPos() >= loopThreshold_))
+			void PopFront()
+			{
+				size_t slot = Find(window_[head_].id);
+				head_ = (head_ + 1) & (window_.size() - 1);
+				size_--;
+				if (--count_[slot].count > 0)
 				{
-					inBuffer.erase(inBuffer.find(buffer.front().GetId()));
-					buffer.pop_front();
+					return;
 				}
 
-				bool ret = inBuffer.find(junction.GetId()) == inBuffer.end();
-				buffer.push_back(junction);
-				inBuffer.insert(junction.GetId());
-				return ret;
+				//Shift back the entries of the probe sequence that can no longer be reached
+				for (size_t next = (slot + 1) & (count_.size() - 1); count_[next].count > 0; next = (next + 1) & (count_.size() - 1))
+				{
+					size_t home = Hash(count_[next].id);
+					if (((next - home) & (count_.size() - 1)) >= ((next - slot) & (count_.size() - 1)))
+					{
+						count_[slot] = count_[next];
+						count_[next].count = 0;
+						slot = next;
+					}
+				}
+			}
+
+			//Grows the ring and rebuilds the table at most half full
+			void Reserve(size_t capacity)
+			{
+				std::vector<RawJunction> window(capacity);
+				for (size_t i = 0; i < size_; i++)
+				{
+					window[i] = window_[(head_ + i) & (window_.size() - 1)];
+				}
+
+				Counter empty = { 0, 0 };
+				window_.swap(window);
+				count_.assign(capacity * 2, empty);
+				head_ = 0;
+				for (size_t i = 0; i < size_; i++)
+				{
+					count_[Find(window_[i].id)].count++;
+				}
 			}
 
+			int64_t loopThreshold_;
+			uint64_t chr_;
+			size_t head_;
+			size_t size_;
+			std::vector<RawJunction> window_;
+			std::vector<Counter> count_;
 		};
 
-		void LockRange(JunctionSequentialIterator start, JunctionSequentialIterator end, std::pair<size_t, size_t> & prevIdx)
+		void LockRange(JunctionSequentialIterator start, JunctionSequentialIterator end, size_t & prevIdx)
 		{
 			do
 			{
 				size_t idx = MutexIdx(start.GetChrId(), start.GetIndex());
-				if (start.GetChrId() != prevIdx.first || idx != prevIdx.second)
+				if (idx != prevIdx)
 				{
-					mutex_[start.GetChrId()][idx].mutex.lock();
-					prevIdx.first = start.GetChrId();
-					prevIdx.second = idx;
+					mutex_[idx].mutex.lock();
+					prevIdx = idx;
 				}
 
 
 			} while (start++ != end);
 		}
 
-		void UnlockRange(JunctionSequentialIterator start, JunctionSequentialIterator end, std::pair<size_t, size_t> & prevIdx)
+		//Both iterators are on the positive strand
+		void MarkRangeUsed(JunctionSequentialIterator start, JunctionSequentialIterator end)
+		{
+			used_.SetRange(start.GetGlobalIndex(), end.GetGlobalIndex() + 1);
+		}
+
+		void UnlockRange(JunctionSequentialIterator start, JunctionSequentialIterator end, size_t & prevIdx)
 		{
 			do
 			{
 				size_t idx = MutexIdx(start.GetChrId(), start.GetIndex());
-				if (start.GetChrId() != prevIdx.first || idx != prevIdx.second)
+				if (idx != prevIdx)
 				{
-					mutex_[start.GetChrId()][idx].mutex.unlock();
-					prevIdx.first = start.GetChrId();
-					prevIdx.second = idx;
+					mutex_[idx].mutex.unlock();
+					prevIdx = idx;
 				}
 
 
@@ -578,14 +737,44 @@ namespace Sibelia
 			return position_.size();
 		}
 
-		const std::string& GetChrSequence(uint64_t idx) const
+		int64_t GetChrLength(uint64_t idx) const
 		{
-			return sequence_[idx];
+			return sequence_.GetLength(idx);
 		}
 
 		const std::string& GetChrDescription(uint64_t idx) const
 		{
-			return sequenceDescription_[idx];
+			return sequence_.GetDescription(idx);
+		}
+
+		void GetChrSubstring(uint64_t idx, size_t start, size_t length, bool reverse, std::string & out) const
+		{
+			sequence_.Extract(idx, start, length, reverse, out);
+		}
+
+		char GetFollowingChar(uint64_t chrId, uint64_t idx) const
+		{
+			if (junctionOnly_)
+			{
+				return junctionChar_[chrStart_[chrId] + idx].following;
+			}
+
+			return sequence_.GetChar(chrId, position_[chrId][idx].pos + k_);
+		}
+
+		char GetPrecedingChar(uint64_t chrId, uint64_t idx) const
+		{
+			if (junctionOnly_)
+			{
+				return junctionChar_[chrStart_[chrId] + idx].preceding;
+			}
+
+			return sequence_.GetChar(chrId, int64_t(position_[chrId][idx].pos) - 1);
+		}
+
+		void LoadSequences()
+		{
+			sequence_.Reload();
 		}
 
 		int64_t GetChrVerticesCount(uint64_t chrId) const
@@ -595,294 +784,1815 @@ namespace Sibelia
 
 		JunctionSequentialIterator GetIterator(uint64_t chrId, uint64_t idx, bool isPositiveStrand = true) const
 		{
-			return JunctionSequentialIterator(chrId, idx, isPositiveStrand);
+			return JunctionSequentialIterator(this, chrId, idx, isPositiveStrand);
 		}
 
 		JunctionSequentialIterator Begin(uint64_t chrId, bool isPositiveStrand = true) const
 		{
-			return JunctionSequentialIterator(chrId, 0, isPositiveStrand);
+			return JunctionSequentialIterator(this, chrId, 0, isPositiveStrand);
 		}
 
 		JunctionSequentialIterator End(uint64_t chrId, bool isPositiveStrand = true) const
 		{
-			return JunctionSequentialIterator(chrId, chrSize_[chrId], isPositiveStrand);
+			return JunctionSequentialIterator(this, chrId, chrSize_[chrId], isPositiveStrand);
 		}
 
 		int64_t GetVerticesNumber() const
 		{
-			return vertex_.size();
+			return vertexNumber_;
+		}
+
+		//Distinct vertices of a sample before the abundance filter
+		int64_t GetSampleVerticesNumber() const
+		{
+			return sampleVertexNumber_;
+		}
+
+		//Vertices of the whole graph when it was read from a stream, zero otherwise
+		int64_t GetStreamVerticesNumber() const
+		{
+			return streamVertexNumber_;
 		}
 
 		uint64_t GetInstancesCount(int64_t vertexId) const
 		{
-			return vertex_[abs(vertexId)].size();
+			return vertex_.begin[abs(vertexId) + 1] - vertex_.begin[abs(vertexId)];
 		}
 
 		size_t MutexNumber() const
 		{
-			return size_t(int64_t(1) << mutexBits_);
+			return chrMutexStart_.back();
 		}
 
 		int64_t IngoingEdgesNumber(int64_t vertexId) const
 		{
-			return ingoingEdge_[vertexId + GetVerticesNumber()].size();
+			return OutgoingEdgesNumber(-vertexId);
 		}
 
 		int64_t OutgoingEdgesNumber(int64_t vertexId) const
 		{
-			return outgoingEdge_[vertexId + GetVerticesNumber()].size();
+			size_t slot = vertexId + GetVerticesNumber();
+			return edgeBegin_[slot + 1] - edgeBegin_[slot];
 		}
 
+		//Ingoing edges of a vertex are the reversed outgoing edges of its reverse complement
 		Edge IngoingEdge(int64_t vertexId, int64_t idx) const
 		{
-			return ingoingEdge_[vertexId + GetVerticesNumber()][idx];
+			return OutgoingEdge(-vertexId, idx).Reverse();
 		}
 
 		Edge OutgoingEdge(int64_t vertexId, int64_t idx) const
 		{
-			return outgoingEdge_[vertexId + GetVerticesNumber()][idx];
+			const AdjacentEdge & edge = edge_[edgeBegin_[vertexId + GetVerticesNumber()] + idx];
+			return Edge(vertexId, edge.endVertex, edge.ch, edge.revCh, edge.length, edge.capacity);
 		}
 
 		void IngoingEdges(int64_t vertexId, std::vector<Edge> & list) const
 		{
 			list.clear();
-			for (auto now : vertex_[abs(vertexId)])
+			for (int64_t idx = 0; idx < IngoingEdgesNumber(vertexId); idx++)
 			{
-				if (now.id == vertexId)
-				{
-					if (now.idx > 0)
-					{
-						const Position & prev = position_[now.chr][now.idx - 1];
-						char ch = sequence_[now.chr][prev.pos + k_];
-						char revCh = TwoPaCo::DnaChar::ReverseChar(sequence_[now.chr][now.pos - 1]);
-						Edge newEdge(prev.id, now.id, ch, revCh, now.pos - prev.pos, 1);
-						auto it = std::find(list.begin(), list.end(), newEdge);
-						if (it == list.end())
-						{
-							list.push_back(newEdge);
-						}
-						else
-						{
-							it->Inc();
-						}
-					}
-				}
-				else
-				{
-					if (now.idx + 1 < chrSize_[now.chr])
-					{
-						const Position & prev = position_[now.chr][now.idx + 1];
-						char ch = TwoPaCo::DnaChar::ReverseChar(sequence_[now.chr][prev.pos - 1]);
-						char revCh = sequence_[now.chr][now.pos + k_];
-						Edge newEdge(-prev.id, -now.id, ch, revCh, prev.pos - now.pos, 1);
-						auto it = std::find(list.begin(), list.end(), newEdge);
-						if (it == list.end())
-						{
-							list.push_back(newEdge);
-						}
-						else
-						{
-							it->Inc();
-						}
-					}
-				}
+				list.push_back(IngoingEdge(vertexId, idx));
 			}
 
 			std::sort(list.begin(), list.end());
-			list.erase(std::unique(list.begin(), list.end()), list.end());
 		}
 
 		void OutgoingEdges(int64_t vertexId, std::vector<Edge> & list) const
 		{
 			list.clear();
-			for (auto now : vertex_[abs(vertexId)])
+			for (int64_t idx = 0; idx < OutgoingEdgesNumber(vertexId); idx++)
 			{
-				if (now.id == vertexId)
-				{
-					if (now.idx + 1 < chrSize_[now.chr])
-					{
-						const Position & next = position_[now.chr][now.idx + 1];
-						char ch = sequence_[now.chr][now.pos + k_];
-						char revCh = TwoPaCo::DnaChar::ReverseChar(sequence_[now.chr][next.pos - 1]);
-						Edge newEdge = Edge(now.id, next.id, ch, revCh, next.pos - now.pos, 1);
-						auto it = std::find(list.begin(), list.end(), newEdge);
-						if (it == list.end())
-						{
-							list.push_back(newEdge);
-						}
-						else
-						{
-							it->Inc();
-						}
+				list.push_back(OutgoingEdge(vertexId, idx));
+			}
+		}
 
-					}
+		//A nonzero sampleLength loads only the first sampleLength bases of every chromosome. The
+		//abundances are then counted on the sample too, so a mapped or compact graph is read
+		//only around the sample and the abundance filter drops fewer vertices than in a full run
+		void Init(const std::string & inFileName,
+			const std::string & genomesFileName,
+			int64_t threads,
+			int64_t abundanceThreshold,
+			int64_t loopThreshold,
+			SequenceStorage::Mode sequenceMode,
+			bool junctionOnly,
+			uint64_t sampleLength = 0)
+		{
+			junctionOnly_ = false;
+			abundanceThreshold_ = abundanceThreshold;
+			loopThreshold_ = loopThreshold;
+			tbb::task_scheduler_init init(static_cast<int>(threads));
+			std::exception_ptr genomesError;
+			std::thread genomesReader([this, &genomesFileName, sequenceMode, &genomesError]()
+			{
+				try
+				{
+					ReadGenomes(genomesFileName, sequenceMode);
 				}
-				else
+				catch (...)
+				{
+					genomesError = std::current_exception();
+				}
+			});
+
+			try
+			{
+				std::vector<uint32_t> abundance;
+				std::vector<RawJunctionVector> junction;
+				bool compact = LoadCompactJunctions(inFileName, sampleLength, junction, abundance);
+				bool mapped = !compact && sampleLength > 0 && LoadMappedSample(inFileName, sampleLength, junction, abundance);
+				if (compact || sampleLength > 0 || !LoadMappedJunctions(inFileName, threads, abundanceThreshold, loopThreshold))
 				{
-					if (now.idx > 0)
+					if (!compact && !mapped)
 					{
-						const Position & next = position_[now.chr][now.idx - 1];
-						char ch = TwoPaCo::DnaChar::ReverseChar(sequence_[now.chr][now.pos - 1]);
-						char revCh = sequence_[now.chr][now.pos + k_];
-						Edge newEdge(-now.id, -next.id, ch, revCh, now.pos - next.pos, 1);
-						auto it = std::find(list.begin(), list.end(), newEdge);
-						if (it == list.end())
-						{
-							list.push_back(newEdge);
-						}
-						else
-						{
-							it->Inc();
-						}
+						ReadJunctions(inFileName, sampleLength, junction, abundance);
 					}
+
+					sampleVertexNumber_ = std::count_if(abundance.begin(), abundance.end(), [](uint32_t count) { return count > 0; });
+					FilterJunctions(junction, abundance, abundanceThreshold, loopThreshold);
+					BuildJunctionIndex(junction, abundance.size());
 				}
 			}
+			catch (...)
+			{
+				genomesReader.join();
+				throw;
+			}
 
-			std::sort(list.begin(), list.end());
-			list.erase(std::unique(list.begin(), list.end()), list.end());
+			genomesReader.join();
+			if (genomesError)
+			{
+				std::rethrow_exception(genomesError);
+			}
+
+			if (sequence_.GetChrNumber() < position_.size())
+			{
+				throw std::runtime_error("The FASTA file has fewer sequences than the graph");
+			}
+
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, vertex_.begin[vertexNumber_]), [this](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t o = range.begin(); o != range.end(); o++)
+				{
+					int64_t chr = vertex_.chr[o];
+					int64_t pos_ = vertex_.pos[o];
+					vertex_.ch[o] = sequence_.GetChar(chr, pos_ + k_);
+					vertex_.revCh[o] = pos_ > 0 ? TwoPaCo::DnaChar::ReverseChar(sequence_.GetChar(chr, pos_ - 1)) : 'N';
+				}
+			});
+
+			FinishInit(threads, junctionOnly);
 		}
 
-		const std::string& GetSequence(size_t idx) const
+		static bool IndexNeedsLargeChromosomes(const std::string & fileName)
 		{
-			return sequence_[idx];
+			IndexHeader header;
+			std::ifstream in(fileName.c_str(), std::ios::binary);
+			return in.read(reinterpret_cast<char*>(&header), sizeof(header)) && header.positionSize > sizeof(Position);
 		}
 
-		void Init(const std::string & inFileName, const std::string & genomesFileName, int64_t threads, int64_t abundanceThreshold, int64_t loopThreshold)
+		//Converts a junction stream written by TwoPaCo into the compact format that Init
+		//recognizes by its header. The stream is cut into blocks of one chromosome, a block
+		//stores the positions as varint deltas and the ids as zigzag varints
+		static void CompactJunctions(const std::string & inFileName, const std::string & outFileName)
 		{
-			this_ = this;
-			std::vector<size_t> abundance;
+			std::ofstream out(outFileName.c_str(), std::ios::binary);
+			if (!out)
 			{
-				TwoPaCo::JunctionPositionReader reader(inFileName);
-				for (TwoPaCo::JunctionPosition junction; reader.NextJunctionPosition(junction);)
-				{
-					if (junction.GetChr() >= chrSize_.size())
-					{
-						chrSize_.push_back(0);
-					}
+				throw std::runtime_error("Cannot open file " + outFileName);
+			}
 
-					size_t absId = abs(junction.GetId());
-					while (absId >= vertex_.size())
-					{
-						vertex_.push_back(VertexVector());
-						abundance.push_back(0);
-					}
+			CompactHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, CompactMagic(), sizeof(header.magic));
+			header.version = COMPACT_VERSION;
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
 
-					++abundance[absId];
+			std::string buffer;
+			uint32_t prevPos = 0;
+			std::vector<CompactBlock> index;
+			CompactBlock block = { sizeof(header), 0, 0, 0, 0, 0 };
+			auto flush = [&]()
+			{
+				if (block.count > 0)
+				{
+					block.size = buffer.size();
+					out.write(buffer.data(), buffer.size());
+					index.push_back(block);
+					block.offset += block.size;
+					block.count = 0;
+					buffer.clear();
 				}
-			}
+			};
 
+			TwoPaCo::JunctionPositionReader reader(inFileName);
+			for (TwoPaCo::JunctionPosition now; reader.NextJunctionPosition(now); header.records++)
 			{
-				Buffer buffer(loopThreshold);
-				TwoPaCo::JunctionPositionReader reader(inFileName);
-				for (TwoPaCo::JunctionPosition junction; reader.NextJunctionPosition(junction);)
+				if (block.count == COMPACT_BLOCK_SIZE || now.GetChr() != block.chr)
 				{
-					size_t absId = abs(junction.GetId());
-					if (abundance[absId] < size_t(abundanceThreshold) && buffer.AddAndCheck(junction))
-					{
-						++chrSize_[junction.GetChr()];
-					}
+					flush();
+					prevPos = now.GetChr() == block.chr ? prevPos : 0;
+					block.chr = now.GetChr();
+					block.basePos = prevPos;
 				}
+
+				int64_t id = now.GetId();
+				uint32_t pos = now.GetPos();
+				EncodeVarint(uint32_t(pos - prevPos), buffer);
+				EncodeVarint((uint64_t(id) << 1) ^ uint64_t(id >> 63), buffer);
+				header.maxId = max(header.maxId, uint64_t(abs(id)));
+				prevPos = pos;
+				block.count++;
 			}
 
-			position_.resize(chrSize_.size());
-			for (size_t i = 0; i < chrSize_.size(); i++)
+			flush();
+			header.blockNumber = index.size();
+			header.indexOffset = block.offset;
+			out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(CompactBlock));
+			out.seekp(0);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			if (!out)
 			{
-				position_[i].reset(new Position[chrSize_[i]]);
+				throw std::runtime_error("Cannot write file " + outFileName);
 			}
+		}
 
-			{
-				uint32_t idx = 0;
-				size_t chr = 0;
-				Buffer buffer(loopThreshold);
-				TwoPaCo::JunctionPositionReader reader(inFileName);
-				for (TwoPaCo::JunctionPosition junction; reader.NextJunctionPosition(junction);)
+		void SaveIndex(const std::string & fileName)
+		{
+			bool released = junctionOnly_;
+			if (released)
+			{
+				sequence_.Reload();
+			}
+
+			IndexHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, IndexMagic(), sizeof(header.magic));
+			header.version = INDEX_VERSION;
+			header.k = k_;
+			header.abundanceThreshold = abundanceThreshold_;
+			header.loopThreshold = loopThreshold_;
+			header.positionSize = sizeof(Position);
+			header.chrNumber = chrSize_.size();
+			header.vertexNumber = vertexNumber_;
+			header.edgeNumber = edgeBegin_[vertexNumber_ * 2];
+			std::vector<uint64_t> sequenceIndex(1, 0);
+			std::vector<uint64_t> descriptionIndex(1, 0);
+
+			for (size_t chr = 0; chr < chrSize_.size(); chr++)
+			{
+				header.positionNumber += chrSize_[chr];
+				sequenceIndex.push_back(sequenceIndex.back() + GetChrLength(chr));
+				descriptionIndex.push_back(descriptionIndex.back() + GetChrDescription(chr).size());
+			}
+
+			size_t offset = IndexAlign(sizeof(header));
+			header.chrSizeOffset = offset;
+			offset = IndexAlign(offset + header.chrNumber * sizeof(uint64_t));
+			header.positionOffset = offset;
+			offset = IndexAlign(offset + header.positionNumber * sizeof(Position));
+			header.vertexOffset = offset;
+			offset = IndexAlign(offset + VertexTable::GetSize(header.vertexNumber, header.positionNumber));
+			header.edgeBeginOffset = offset;
+			offset = IndexAlign(offset + (header.vertexNumber * 2 + 1) * sizeof(uint64_t));
+			header.edgeOffset = offset;
+			offset = IndexAlign(offset + header.edgeNumber * sizeof(AdjacentEdge));
+			header.usedOffset = offset;
+			offset = IndexAlign(offset + (header.positionNumber + 63) / 64 * sizeof(uint64_t));
+			header.sequenceIndexOffset = offset;
+			offset = IndexAlign(offset + sequenceIndex.size() * sizeof(uint64_t));
+			header.sequenceOffset = offset;
+			offset = IndexAlign(offset + sequenceIndex.back());
+			header.descriptionIndexOffset = offset;
+			offset = IndexAlign(offset + descriptionIndex.size() * sizeof(uint64_t));
+			header.descriptionOffset = offset;
+			header.fileSize = offset + descriptionIndex.back();
+
+			std::ofstream out(fileName.c_str(), std::ios::binary);
+			if (!out)
+			{
+				throw std::runtime_error("Cannot open file " + fileName);
+			}
+
+			size_t written = 0;
+			const std::vector<char> zero(INDEX_ALIGNMENT, 0);
+			auto write = [&](size_t at, const void * data, size_t size)
+			{
+				while (written < at)
 				{
-					if (junction.GetChr() > chr)
-					{
-						chr++;
-						idx = 0;
-					}
+					size_t pad = min(at - written, zero.size());
+					out.write(zero.data(), pad);
+					written += pad;
+				}
 
-					size_t absId = abs(junction.GetId());
-					if (abundance[absId] < size_t(abundanceThreshold) && buffer.AddAndCheck(junction))
-					{
-						position_[junction.GetChr()][idx].Assign(junction);
-						vertex_[absId].push_back(Vertex(junction));
-						vertex_[absId].back().idx = idx++;
-					}
-					else
-					{
+				out.write(static_cast<const char*>(data), size);
+				written += size;
+			};
 
-					}
-				}
+			std::vector<uint64_t> chrSize(chrSize_.begin(), chrSize_.end());
+			write(0, &header, sizeof(header));
+			write(header.chrSizeOffset, chrSize.data(), chrSize.size() * sizeof(uint64_t));
+			write(header.positionOffset, 0, 0);
+			for (size_t chr = 0; chr < chrSize_.size(); chr++)
+			{
+				write(written, position_[chr], chrSize_[chr] * sizeof(Position));
 			}
 
+			write(header.vertexOffset, vertex_.begin, VertexTable::GetSize(header.vertexNumber, header.positionNumber));
+			write(header.edgeBeginOffset, edgeBegin_, (header.vertexNumber * 2 + 1) * sizeof(uint64_t));
+			write(header.edgeOffset, edge_, header.edgeNumber * sizeof(AdjacentEdge));
+
+			//The used flags are all clear, so the padding up to the next section writes them
 
-			size_t record = 0;
-			sequence_.resize(position_.size());
-			for (TwoPaCo::StreamFastaParser parser(genomesFileName); parser.ReadRecord(); record++)
+			std::string buffer;
+			write(header.sequenceIndexOffset, sequenceIndex.data(), sequenceIndex.size() * sizeof(uint64_t));
+			write(header.sequenceOffset, 0, 0);
+			for (size_t chr = 0; chr < chrSize_.size(); chr++)
 			{
-				sequenceDescription_.push_back(parser.GetCurrentHeader());
-				sequenceId_[parser.GetCurrentHeader()] = sequenceDescription_.size() - 1;
-				for (char ch; parser.GetChar(ch); )
+				for (size_t start = 0; start < size_t(GetChrLength(chr)); start += INDEX_SEQUENCE_BLOCK)
 				{
-					sequence_[record].push_back(ch);
+					size_t length = std::min(size_t(INDEX_SEQUENCE_BLOCK), size_t(GetChrLength(chr) - start));
+					GetChrSubstring(chr, start, length, false, buffer);
+					write(written, buffer.data(), buffer.size());
 				}
 			}
 
-			for (size_t i = 0; i < vertex_.size(); i++)
+			write(header.descriptionIndexOffset, descriptionIndex.data(), descriptionIndex.size() * sizeof(uint64_t));
+			write(header.descriptionOffset, 0, 0);
+			for (size_t chr = 0; chr < chrSize_.size(); chr++)
 			{
-				for (size_t j = 0; j < vertex_[i].size(); j++)
-				{
-					int64_t chr = vertex_[i][j].chr;
-					int64_t pos_ = vertex_[i][j].pos;
-					vertex_[i][j].ch = sequence_[chr][pos_ + JunctionStorage::this_->k_];
-					vertex_[i][j].revCh = pos_ > 0 ? TwoPaCo::DnaChar::ReverseChar(sequence_[chr][pos_ - 1]) : 'N';
-				}
+				write(written, GetChrDescription(chr).data(), GetChrDescription(chr).size());
+			}
+
+			if (!out)
+			{
+				throw std::runtime_error("Cannot write the index to " + fileName);
+			}
+
+			if (released)
+			{
+				sequence_.Release();
+			}
+		}
+
+		//Positions, vertices, adjacency and sequences are used straight from the mapped index.
+		//The mapping is private, and only the used flags are written to it, so every other page
+		//stays a clean page of the file. In the out-of-core mode the kernel can drop them under
+		//memory pressure and read them back, and the lookups by vertex id get no readahead
+		void LoadIndex(const std::string & fileName, int64_t threads, int64_t abundanceThreshold, int64_t loopThreshold, bool junctionOnly, bool outOfCore = false)
+		{
+			junctionOnly_ = false;
+			outOfCore_ = outOfCore;
+			abundanceThreshold_ = abundanceThreshold;
+			loopThreshold_ = loopThreshold;
+			tbb::task_scheduler_init init(static_cast<int>(threads));
+			IndexHeader header;
+			if (!index_.Open(fileName, true) || index_.GetSize() < sizeof(header))
+			{
+				throw std::runtime_error("Cannot open the index file " + fileName);
+			}
+
+			char * data = index_.GetData();
+			memcpy(&header, data, sizeof(header));
+			if (memcmp(header.magic, IndexMagic(), sizeof(header.magic)) != 0 ||
+				header.version != INDEX_VERSION ||
+				header.fileSize != index_.GetSize())
+			{
+				throw std::runtime_error("The index file " + fileName + " is damaged or was built by another version");
 			}
 
-			mutex_.resize(GetChrNumber());
-			chrSizeBits_.resize(GetChrNumber(), 1);
-			for (mutexBits_ = 3; (int64_t(1) << mutexBits_) < threads * (1 << 7); mutexBits_++);
-			for (size_t i = 0; i < mutex_.size(); i++)
+			if (header.positionSize != sizeof(Position))
 			{
-				mutex_[i].reset(new FlaggedMutex[int64_t(1) << mutexBits_]);
-				for (; size_t(int64_t(1) << chrSizeBits_[i]) <= chrSize_[i]; chrSizeBits_[i]++);
-				chrSizeBits_[i] = max(int64_t(0), chrSizeBits_[i] - mutexBits_);
+				throw std::runtime_error("The index file " + fileName + " was built for a different chromosome length limit");
 			}
+
+			if (header.k != uint64_t(k_) || header.abundanceThreshold != uint64_t(abundanceThreshold) || header.loopThreshold != uint64_t(loopThreshold))
+			{
+				std::stringstream ss;
+				ss << "The index file " << fileName << " was built with k = " << header.k << ", abundance = " << header.abundanceThreshold << " and loop threshold = " << header.loopThreshold;
+				ss << ", but k = " << k_ << ", abundance = " << abundanceThreshold << " and loop threshold = " << loopThreshold << " were requested";
+				throw std::runtime_error(ss.str());
+			}
+
+			const uint64_t * chrSize = reinterpret_cast<const uint64_t*>(data + header.chrSizeOffset);
+			const uint64_t * sequenceIndex = reinterpret_cast<const uint64_t*>(data + header.sequenceIndexOffset);
+			const uint64_t * descriptionIndex = reinterpret_cast<const uint64_t*>(data + header.descriptionIndexOffset);
+			chrSize_.assign(chrSize, chrSize + header.chrNumber);
+			PlacePositions(reinterpret_cast<Position*>(data + header.positionOffset));
+
+			vertexNumber_ = header.vertexNumber;
+			vertex_.Place(data + header.vertexOffset, header.vertexNumber, header.positionNumber);
+			edgeBegin_ = reinterpret_cast<const uint64_t*>(data + header.edgeBeginOffset);
+			edge_ = reinterpret_cast<const AdjacentEdge*>(data + header.edgeOffset);
+			used_.Place(reinterpret_cast<std::atomic<uint64_t>*>(data + header.usedOffset), header.positionNumber);
+			if (outOfCore)
+			{
+				index_.Advise(header.vertexOffset, header.usedOffset - header.vertexOffset, MADV_RANDOM);
+			}
+
+			std::vector<size_t> offset;
+			std::vector<size_t> length;
+			std::vector<std::string> description;
+			for (size_t chr = 0; chr < header.chrNumber; chr++)
+			{
+				offset.push_back(header.sequenceOffset + sequenceIndex[chr]);
+				length.push_back(sequenceIndex[chr + 1] - sequenceIndex[chr]);
+				description.push_back(std::string(data + header.descriptionOffset + descriptionIndex[chr], data + header.descriptionOffset + descriptionIndex[chr + 1]));
+				sequenceId_[description.back()] = chr;
+			}
+
+			sequence_.InitContiguous(fileName, description, offset, length);
+			if (outOfCore)
+			{
+				sequence_.Advise(MADV_RANDOM);
+			}
+
+			FinishInit(threads, junctionOnly, true);
 		}
 
-		JunctionStorage() {}
-		JunctionStorage(const std::string & fileName, const std::string & genomesFileName, uint64_t k, int64_t threads, int64_t abundanceThreshold, int64_t loopThreshold) : k_(k)
+		JunctionStorage(uint64_t k) : k_(k), outOfCore_(false), edgeBegin_(0), edge_(0), sampleVertexNumber_(0), streamVertexNumber_(0)
 		{
-			Init(fileName, genomesFileName, threads, abundanceThreshold, loopThreshold);
+
 		}
 
-		bool IsSequencePresent(const std::string & str) const
+		JunctionStorage(const std::string & fileName,
+			const std::string & genomesFileName,
+			uint64_t k,
+			int64_t threads,
+			int64_t abundanceThreshold,
+			int64_t loopThreshold,
+			SequenceStorage::Mode sequenceMode = SequenceStorage::PLAIN,
+			bool junctionOnly = false) : k_(k), outOfCore_(false), edgeBegin_(0), edge_(0), sampleVertexNumber_(0), streamVertexNumber_(0)
 		{
-			return sequenceId_.count(str) > 0;
+			Init(fileName, genomesFileName, threads, abundanceThreshold, loopThreshold, sequenceMode, junctionOnly);
 		}
 
-		size_t GetSequenceId(const std::string & str) const
+		bool IsOutOfCore() const
 		{
-			return sequenceId_.find(str)->second;
+			return outOfCore_;
 		}
 
-	private:
+		//Bytes of the heap held by the storage. Arrays placed in a mapped index are not counted
+		uint64_t GetMemoryUsage() const
+		{
+			uint64_t ret = sequence_.GetMemoryUsage() + edgeBeginBuffer_.GetMemoryUsage() + edgeBuffer_.GetMemoryUsage();
+			ret += used_.GetMemoryUsage() + MutexNumber() * sizeof(FlaggedMutex);
+			ret += positionBuffer_.GetMemoryUsage() + vertexBuffer_.GetMemoryUsage() + junctionChar_.GetMemoryUsage();
+			return ret;
+		}
 
-		struct LightEdge
+		struct InputSize
 		{
-			int64_t vertex;
-			char ch;
+			//MEASURED counts come from the graph file. A graph read from a pipe has at most one
+			//junction per base, so the FASTA file gives an upper BOUND for it
+			enum Kind
+			{
+				UNKNOWN,
+				BOUND,
+				MEASURED
+			};
+
+			Kind kind;
+			uint64_t records;
+			uint64_t vertices;
+			uint64_t bases;
+			uint64_t chromosomes;
 		};
 
-		size_t MutexIdx(size_t chrId, size_t idx) const
+		struct MemoryEstimate
 		{
-			size_t ret = idx >> chrSizeBits_[chrId];
-			assert(ret < MutexNumber());
+			uint64_t positions;
+			uint64_t vertices;
+			uint64_t sequences;
+			uint64_t junctionChars;
+			uint64_t adjacency;
+			uint64_t usedFlags;
+			uint64_t locks;
+			uint64_t build;
+
+			uint64_t GetSearchTotal() const
+			{
+				return positions + vertices + sequences + junctionChars + adjacency + usedFlags + locks;
+			}
+		};
+
+		//Measures the input without loading it: the junction count comes from the size of a
+		//raw graph or the header of a compact one, the vertex count from the largest id in a
+		//sample of the records and the bases from the size of the FASTA file. A graph coming
+		//from a pipe cannot be measured, so both counts are bounded by the bases then
+		static InputSize MeasureInput(const std::string & inFileName, const std::string & genomesFileName)
+		{
+			InputSize ret = { InputSize::UNKNOWN, 0, 0, 0, 0 };
+			struct stat info;
+			if (stat(genomesFileName.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+			{
+				ret.bases = info.st_size;
+				ret.chromosomes = SequenceStorage::CountRecords(genomesFileName);
+			}
+
+			MappedFile file;
+			CompactHeader header;
+			if (!file.Open(inFileName))
+			{
+				if (ret.bases > 0)
+				{
+					ret.kind = InputSize::BOUND;
+					ret.records = ret.bases;
+					ret.vertices = ret.bases + 1;
+				}
+
+				return ret;
+			}
+
+			if (file.GetSize() >= sizeof(header))
+			{
+				memcpy(&header, file.GetData(), sizeof(header));
+				if (memcmp(header.magic, CompactMagic(), sizeof(header.magic)) == 0)
+				{
+					if (header.version == COMPACT_VERSION)
+					{
+						ret.kind = InputSize::MEASURED;
+						ret.records = header.records;
+						ret.vertices = header.maxId + 1;
+					}
+
+					return ret;
+				}
+			}
+
+			//Anything that is not a sequence of records sorted by chromosome cannot be measured
+			if (!IsJunctionFile(inFileName, file))
+			{
+				return ret;
+			}
+
+			uint32_t prevChr = 0;
+			uint64_t records = file.GetSize() / JUNCTION_RECORD_SIZE;
+			size_t step = max(size_t(1), size_t(records / ESTIMATE_SAMPLE_SIZE));
+			for (size_t i = 0; i < records; i += step)
+			{
+				uint32_t chr;
+				RawJunction now;
+				DecodeJunction(file.GetData() + i * JUNCTION_RECORD_SIZE, chr, now);
+				if (chr < prevChr || (ret.chromosomes > 0 && chr >= ret.chromosomes))
+				{
+					ret.vertices = 0;
+					return ret;
+				}
+
+				prevChr = chr;
+				ret.vertices = max(ret.vertices, uint64_t(abs(now.id)) + 1);
+			}
+
+			ret.kind = InputSize::MEASURED;
+			ret.records = records;
+			ret.vertices = min(ret.vertices, ret.records + 1);
 			return ret;
 		}
 
+		//Reads the counts of an index from its header and sequence table
+		static InputSize MeasureIndex(const std::string & fileName)
+		{
+			IndexHeader header;
+			InputSize ret = { InputSize::UNKNOWN, 0, 0, 0, 0 };
+			std::ifstream in(fileName.c_str(), std::ios::binary);
+			if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || memcmp(header.magic, IndexMagic(), sizeof(header.magic)) != 0 || header.version != INDEX_VERSION)
+			{
+				return ret;
+			}
+
+			uint64_t bases = 0;
+			in.seekg(header.sequenceIndexOffset + header.chrNumber * sizeof(uint64_t));
+			if (in.read(reinterpret_cast<char*>(&bases), sizeof(bases)))
+			{
+				ret.kind = InputSize::MEASURED;
+				ret.records = header.positionNumber;
+				ret.vertices = header.vertexNumber;
+				ret.bases = bases;
+				ret.chromosomes = header.chrNumber;
+			}
+
+			return ret;
+		}
+
+		//Projects the sizes of the arrays of the storage. The building peak includes the raw
+		//junctions and, in the junction-only mode, the moment before the genomes are released
+		static MemoryEstimate EstimateMemory(const InputSize & input, SequenceStorage::Mode mode, bool junctionOnly, int64_t threads)
+		{
+			MemoryEstimate ret;
+			uint64_t sequence = mode == SequenceStorage::PLAIN ? input.bases : (mode == SequenceStorage::PACKED ? input.bases / 4 : 0);
+			ret.positions = input.records * sizeof(Position);
+			ret.vertices = VertexTable::GetSize(input.vertices, input.records);
+			ret.sequences = junctionOnly ? 0 : sequence;
+			ret.junctionChars = junctionOnly ? input.records * sizeof(JunctionChar) : 0;
+			ret.adjacency = (input.vertices * 2 + 1) * sizeof(uint64_t) + input.records * 2 * sizeof(AdjacentEdge);
+			ret.usedFlags = (input.records + 63) / 64 * sizeof(uint64_t);
+			ret.locks = ((size_t(1) << GetMutexBits(threads)) + input.chromosomes * ((size_t(2) << MIN_CHR_STRIPE_BITS) + 1)) * sizeof(FlaggedMutex);
+			uint64_t raw = sequence + ret.positions + ret.vertices + input.records * sizeof(RawJunction) + input.vertices * sizeof(uint32_t);
+			ret.build = max(raw, ret.GetSearchTotal() - ret.sequences + sequence);
+			return ret;
+		}
+
+		//Picks the first configuration, from the requested one to the leanest, whose estimated
+		//peak fits into the budget together with reserve bytes for the search: packed
+		//sequences first, then keeping only the junction chars. If none fits, the leanest one
+		//is picked, its peak is returned in peak and the result is false
+		static bool FitMemoryBudget(const InputSize & input, uint64_t budget, uint64_t reserve, int64_t threads, SequenceStorage::Mode & mode, bool & junctionOnly, uint64_t & peak)
+		{
+			std::vector<std::pair<SequenceStorage::Mode, bool> > config(1, std::make_pair(mode, junctionOnly));
+			config.push_back(std::make_pair(mode == SequenceStorage::MAPPED ? mode : SequenceStorage::PACKED, junctionOnly));
+			config.push_back(std::make_pair(config.back().first, true));
+			for (size_t i = 0; i < config.size(); i++)
+			{
+				MemoryEstimate estimate = EstimateMemory(input, config[i].first, config[i].second, threads);
+				peak = max(estimate.build, estimate.GetSearchTotal() + reserve);
+				mode = config[i].first;
+				junctionOnly = config[i].second;
+				if (peak <= budget)
+				{
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		bool IsSequencePresent(const std::string & str) const
+		{
+			return sequenceId_.count(str) > 0;
+		}
+
+		size_t GetSequenceId(const std::string & str) const
+		{
+			return sequenceId_.find(str)->second;
+		}
+
+	private:
+
+		//The adjacency and the used flags of a loaded index are already placed in its mapping
+		void FinishInit(int64_t threads, bool junctionOnly, bool placed = false)
+		{
+			if (!placed)
+			{
+				BuildAdjacency();
+				used_.Init(GetPositionsNumber());
+			}
+
+			if (junctionOnly)
+			{
+				LargeArray<JunctionChar> junctionChar;
+				junctionChar.Allocate(GetPositionsNumber());
+				tbb::parallel_for(tbb::blocked_range<size_t>(0, position_.size(), 1), [this, &junctionChar](const tbb::blocked_range<size_t> & range)
+				{
+					for (size_t chr = range.begin(); chr != range.end(); chr++)
+					{
+						for (size_t idx = 0; idx < chrSize_[chr]; idx++)
+						{
+							junctionChar[chrStart_[chr] + idx].following = GetFollowingChar(chr, idx);
+							junctionChar[chrStart_[chr] + idx].preceding = GetPrecedingChar(chr, idx);
+						}
+					}
+				});
+
+				junctionChar_.Swap(junctionChar);
+
+				junctionOnly_ = true;
+				sequence_.Release();
+			}
+
+			//A stripe covers 2^positionBits junctions, which gives the genome about 1024 stripes
+			//per thread. A chromosome never shares a stripe with another one and is cut into
+			//at least 2^MIN_CHR_STRIPE_BITS stripes, or one per junction if it is shorter
+			int64_t mutexBits = GetMutexBits(threads);
+			int64_t positionBits = 1;
+			for (; (size_t(1) << positionBits) <= GetPositionsNumber(); positionBits++);
+			positionBits = max(int64_t(0), positionBits - mutexBits);
+			chrMutexBits_.resize(chrSize_.size());
+			chrMutexStart_.assign(1, 0);
+			for (size_t chr = 0; chr < chrSize_.size(); chr++)
+			{
+				int64_t sizeBits = 0;
+				for (; (size_t(2) << sizeBits) <= chrSize_[chr]; sizeBits++);
+				chrMutexBits_[chr] = min(positionBits, max(int64_t(0), sizeBits - MIN_CHR_STRIPE_BITS));
+				size_t stripes = chrSize_[chr] > 0 ? ((chrSize_[chr] - 1) >> chrMutexBits_[chr]) + 1 : 0;
+				chrMutexStart_.push_back(chrMutexStart_.back() + stripes);
+			}
+
+			mutex_.reset(new FlaggedMutex[MutexNumber()]);
+		}
+
+		//Every occurrence of a vertex on the positive strand gives an edge to the next junction,
+		//and every occurrence on the negative strand gives an edge to the reversed previous one
+		void CollectOutgoingEdges(int64_t vertexId, std::vector<Edge> & list) const
+		{
+			list.clear();
+			for (size_t o = vertex_.begin[abs(vertexId)]; o < vertex_.begin[abs(vertexId) + 1]; o++)
+			{
+				size_t chr = vertex_.chr[o];
+				size_t idx = vertex_.idx[o];
+				if (vertex_.positive[o] == (vertexId > 0))
+				{
+					if (idx + 1 < chrSize_[chr])
+					{
+						const Position & next = position_[chr][idx + 1];
+						char ch = GetFollowingChar(chr, idx);
+						char revCh = TwoPaCo::DnaChar::ReverseChar(GetPrecedingChar(chr, idx + 1));
+						list.push_back(Edge(vertexId, next.id, ch, revCh, next.pos - vertex_.pos[o], 1));
+					}
+				}
+				else if (idx > 0)
+				{
+					const Position & next = position_[chr][idx - 1];
+					char ch = TwoPaCo::DnaChar::ReverseChar(GetPrecedingChar(chr, idx));
+					char revCh = GetFollowingChar(chr, idx - 1);
+					list.push_back(Edge(vertexId, -next.id, ch, revCh, vertex_.pos[o] - next.pos, 1));
+				}
+			}
+
+			std::stable_sort(list.begin(), list.end());
+			size_t unique = 0;
+			for (size_t i = 0; i < list.size(); i++)
+			{
+				if (unique > 0 && list[unique - 1] == list[i])
+				{
+					list[unique - 1].Inc();
+				}
+				else
+				{
+					list[unique++] = list[i];
+				}
+			}
+
+			list.resize(unique);
+		}
+
+		void BuildAdjacency()
+		{
+			size_t slots = vertexNumber_ * 2;
+			edgeBeginBuffer_.Assign(slots + 1, 0);
+			edgeBegin_ = edgeBeginBuffer_.GetData();
+			for (size_t pass = 0; pass < 2; pass++)
+			{
+				tbb::parallel_for(tbb::blocked_range<size_t>(1, vertexNumber_), [this, pass](const tbb::blocked_range<size_t> & range)
+				{
+					std::vector<Edge> list;
+					for (size_t v = range.begin(); v != range.end(); v++)
+					{
+						for (int64_t vertexId : { int64_t(v), -int64_t(v) })
+						{
+							size_t slot = vertexId + vertexNumber_;
+							CollectOutgoingEdges(vertexId, list);
+							if (pass == 0)
+							{
+								edgeBeginBuffer_[slot + 1] = list.size();
+								continue;
+							}
+
+							for (size_t i = 0; i < list.size(); i++)
+							{
+								AdjacentEdge & edge = edgeBuffer_[edgeBegin_[slot] + i];
+								edge.endVertex = int32_t(list[i].GetEndVertex());
+								edge.length = Offset(list[i].GetLength());
+								edge.capacity = uint32_t(list[i].GetCapacity());
+								edge.ch = list[i].GetChar();
+								edge.revCh = list[i].GetRevChar();
+							}
+						}
+					}
+				});
+
+				if (pass == 0)
+				{
+					for (size_t slot = 0; slot < slots; slot++)
+					{
+						edgeBeginBuffer_[slot + 1] += edgeBegin_[slot];
+					}
+
+					edgeBuffer_.Allocate(edgeBegin_[slots]);
+					edge_ = edgeBuffer_.GetData();
+				}
+			}
+
+			assert(AdjacencyMatchesIterators());
+		}
+
+		//Walks every junction on both strands and checks that the edges the iterators give
+		//are found in the adjacency with the same characters and length
+		bool AdjacencyMatchesIterators() const
+		{
+			for (size_t chr = 0; chr < chrSize_.size(); chr++)
+			{
+				for (size_t idx = 0; idx < chrSize_[chr]; idx++)
+				{
+					for (bool positive : { true, false })
+					{
+						JunctionSequentialIterator it(this, chr, idx, positive);
+						if ((positive ? idx + 1 < chrSize_[chr] : idx > 0) && !HasAdjacentEdge(it.OutgoingEdge()))
+						{
+							return false;
+						}
+
+						if ((positive ? idx > 0 : idx + 1 < chrSize_[chr]) && !HasAdjacentEdge(it.IngoingEdge()))
+						{
+							return false;
+						}
+					}
+				}
+			}
+
+			return true;
+		}
+
+		bool HasAdjacentEdge(const Edge & edge) const
+		{
+			for (int64_t idx = 0; idx < OutgoingEdgesNumber(edge.GetStartVertex()); idx++)
+			{
+				Edge now = OutgoingEdge(edge.GetStartVertex(), idx);
+				if (now == edge)
+				{
+					return now.GetRevChar() == edge.GetRevChar() && now.GetLength() == edge.GetLength();
+				}
+			}
+
+			return false;
+		}
+
+		void AllocatePositions()
+		{
+			size_t positions = 0;
+			for (size_t chr = 0; chr < chrSize_.size(); chr++)
+			{
+				positions += chrSize_[chr];
+			}
+
+			positionBuffer_.Allocate(positions);
+			PlacePositions(positionBuffer_.GetData());
+		}
+
+		//Junctions of all chromosomes form one concatenated coordinate space, chromosome chr
+		//occupies [chrStart_[chr], chrStart_[chr + 1]) in it
+		void PlacePositions(Position * position)
+		{
+			position_.resize(chrSize_.size());
+			chrStart_.assign(1, 0);
+			for (size_t chr = 0; chr < chrSize_.size(); chr++)
+			{
+				position_[chr] = position + chrStart_.back();
+				chrStart_.push_back(chrStart_.back() + chrSize_[chr]);
+			}
+		}
+
+		size_t GetPositionsNumber() const
+		{
+			return chrStart_.back();
+		}
+
+		void AllocateVertices(size_t vertices)
+		{
+			size_t occurrences = GetPositionsNumber();
+			vertexNumber_ = vertices;
+			vertexBuffer_.Allocate(VertexTable::GetSize(vertices, occurrences) / sizeof(uint64_t));
+			vertex_.Place(reinterpret_cast<char*>(vertexBuffer_.GetData()), vertices, occurrences);
+			vertex_.begin[0] = 0;
+		}
+
+		void ReadGenomes(const std::string & genomesFileName, SequenceStorage::Mode sequenceMode)
+		{
+			sequence_.Init(genomesFileName, sequenceMode);
+			for (size_t i = 0; i < sequence_.GetChrNumber(); i++)
+			{
+				sequenceId_[sequence_.GetDescription(i)] = i;
+			}
+		}
+
+		//The junction stream is read exactly once, so inFileName can be a pipe or a FIFO that
+		//TwoPaCo is still writing to. Decoding runs in a separate thread and hands the junctions
+		//over in batches through a bounded queue, an empty batch marks the end of the stream.
+		//A nonzero sampleLength keeps only the junctions in the first sampleLength bases of
+		//every chromosome and counts the abundances on them. A pipe is still read to its end,
+		//because the sample of the last chromosome comes last
+		void ReadJunctions(const std::string & inFileName, uint64_t sampleLength, std::vector<RawJunctionVector> & junction, std::vector<uint32_t> & abundance)
+		{
+			std::vector<bool> sampled;
+			std::exception_ptr readerError;
+			tbb::concurrent_bounded_queue<JunctionBatch> queue;
+			queue.set_capacity(JUNCTION_QUEUE_CAPACITY);
+			std::thread reader([&inFileName, &queue, &readerError]()
+			{
+				try
+				{
+					JunctionBatch batch;
+					TwoPaCo::JunctionPositionReader reader(inFileName);
+					for (TwoPaCo::JunctionPosition now; reader.NextJunctionPosition(now);)
+					{
+						batch.push_back(now);
+						if (batch.size() == JUNCTION_BATCH_SIZE)
+						{
+							queue.push(batch);
+							batch.clear();
+						}
+					}
+
+					if (!batch.empty())
+					{
+						queue.push(batch);
+					}
+				}
+				catch (...)
+				{
+					readerError = std::current_exception();
+				}
+
+				try
+				{
+					queue.push(JunctionBatch());
+				}
+				catch (...)
+				{
+
+				}
+			});
+
+			try
+			{
+				for (JunctionBatch batch; queue.pop(batch), !batch.empty();)
+				{
+					for (const TwoPaCo::JunctionPosition & now : batch)
+					{
+						size_t chr = now.GetChr();
+						size_t absId = abs(now.GetId());
+						streamVertexNumber_ = max(streamVertexNumber_, absId + 1);
+						if (chr >= junction.size())
+						{
+							junction.resize(chr + 1);
+							sampled.resize(chr + 1, true);
+						}
+
+						sampled[chr] = sampled[chr] && (sampleLength == 0 || now.GetPos() < sampleLength);
+						if (sampled[chr])
+						{
+							if (absId >= abundance.size())
+							{
+								abundance.resize(absId + 1, 0);
+							}
+
+							++abundance[absId];
+							RawJunction raw = { static_cast<int32_t>(now.GetId()), now.GetPos() };
+							junction[chr].push_back(raw);
+						}
+					}
+				}
+			}
+			catch (...)
+			{
+				queue.abort();
+				reader.join();
+				throw;
+			}
+
+			reader.join();
+			if (readerError)
+			{
+				std::rethrow_exception(readerError);
+			}
+		}
+
+		void FilterJunctions(std::vector<RawJunctionVector> & junction, const std::vector<uint32_t> & abundance, int64_t abundanceThreshold, int64_t loopThreshold) const
+		{
+			Buffer buffer(loopThreshold);
+			for (size_t chr = 0; chr < junction.size(); chr++)
+			{
+				size_t kept = 0;
+				for (size_t i = 0; i < junction[chr].size(); i++)
+				{
+					size_t absId = abs(junction[chr][i].id);
+					if (abundance[absId] < size_t(abundanceThreshold) && buffer.AddAndCheck(chr, junction[chr][i]))
+					{
+						junction[chr][kept++] = junction[chr][i];
+					}
+				}
+
+				junction[chr].resize(kept);
+			}
+		}
+
+		void BuildJunctionIndex(std::vector<RawJunctionVector> & junction, size_t vertices)
+		{
+			chrSize_.resize(junction.size());
+			for (size_t chr = 0; chr < junction.size(); chr++)
+			{
+				chrSize_[chr] = junction[chr].size();
+			}
+
+			AllocatePositions();
+			for (size_t chr = 0; chr < junction.size(); chr++)
+			{
+				for (size_t idx = 0; idx < chrSize_[chr]; idx++)
+				{
+					position_[chr][idx].Assign(junction[chr][idx].id, junction[chr][idx].pos);
+				}
+
+				RawJunctionVector().swap(junction[chr]);
+			}
+
+			UnwrapPositions();
+			BuildVertexTable(RenumberVertices(vertices));
+		}
+
+		//TwoPaCo writes 32-bit positions. Junctions of a chromosome come in increasing order,
+		//so a position smaller than the previous one means that it wrapped around 2^32
+		void UnwrapPositions()
+		{
+#ifdef _LARGE_CHROMOSOMES_
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, chrSize_.size(), 1), [this](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t chr = range.begin(); chr != range.end(); chr++)
+				{
+					Offset high = 0;
+					for (size_t idx = 1; idx < chrSize_[chr]; idx++)
+					{
+						if (uint32_t(position_[chr][idx].pos) < uint32_t(position_[chr][idx - 1].pos))
+						{
+							high += Offset(1) << 32;
+						}
+
+						position_[chr][idx].pos = high | uint32_t(position_[chr][idx].pos);
+					}
+				}
+			});
+#endif
+		}
+
+		//Gives the vertices left after the filtering dense ids in the order of their first occurrence
+		//along the genomes, so the per-vertex arrays do not depend on the largest id in the graph
+		size_t RenumberVertices(size_t vertices)
+		{
+			Position * position = positionBuffer_.GetData();
+			size_t positions = GetPositionsNumber();
+			size_t blocks = (positions + RENUMBER_BLOCK - 1) / RENUMBER_BLOCK;
+			std::vector<uint32_t> newId(vertices);
+			std::vector<size_t> blockStart(blocks + 1, 0);
+			std::unique_ptr<std::atomic<uint64_t>[]> first(new std::atomic<uint64_t>[vertices]);
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, vertices), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t i = range.begin(); i != range.end(); i++)
+				{
+					first[i].store(UINT64_MAX, std::memory_order_relaxed);
+				}
+			});
+
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, positions), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t p = range.begin(); p != range.end(); p++)
+				{
+					std::atomic<uint64_t> & now = first[abs(position[p].id)];
+					for (uint64_t value = now.load(std::memory_order_relaxed); p < value && !now.compare_exchange_weak(value, p, std::memory_order_relaxed););
+				}
+			});
+
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, blocks), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t b = range.begin(); b != range.end(); b++)
+				{
+					for (size_t p = b * RENUMBER_BLOCK; p < min(positions, (b + 1) * RENUMBER_BLOCK); p++)
+					{
+						blockStart[b + 1] += first[abs(position[p].id)].load(std::memory_order_relaxed) == p ? 1 : 0;
+					}
+				}
+			});
+
+			blockStart[0] = 1;
+			for (size_t b = 0; b < blocks; b++)
+			{
+				blockStart[b + 1] += blockStart[b];
+			}
+
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, blocks), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t b = range.begin(); b != range.end(); b++)
+				{
+					size_t next = blockStart[b];
+					for (size_t p = b * RENUMBER_BLOCK; p < min(positions, (b + 1) * RENUMBER_BLOCK); p++)
+					{
+						if (first[abs(position[p].id)].load(std::memory_order_relaxed) == p)
+						{
+							newId[abs(position[p].id)] = uint32_t(next++);
+						}
+					}
+				}
+			});
+
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, positions), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t p = range.begin(); p != range.end(); p++)
+				{
+					int32_t id = int32_t(newId[abs(position[p].id)]);
+					position[p].id = position[p].id > 0 ? id : -id;
+				}
+			});
+
+			return blockStart[blocks];
+		}
+
+		void BuildVertexTable(size_t vertices)
+		{
+			std::unique_ptr<std::atomic<uint32_t>[]> occurrence(new std::atomic<uint32_t>[vertices]);
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, vertices), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t i = range.begin(); i != range.end(); i++)
+				{
+					occurrence[i].store(0, std::memory_order_relaxed);
+				}
+			});
+
+			Position * position = positionBuffer_.GetData();
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, GetPositionsNumber()), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t p = range.begin(); p != range.end(); p++)
+				{
+					occurrence[abs(position[p].id)].fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+
+			AllocateVertices(vertices);
+			for (size_t i = 0; i < vertices; i++)
+			{
+				vertex_.begin[i + 1] = vertex_.begin[i] + occurrence[i].load(std::memory_order_relaxed);
+				occurrence[i].store(0, std::memory_order_relaxed);
+			}
+
+			for (size_t chr = 0; chr < chrSize_.size(); chr++)
+			{
+				tbb::parallel_for(tbb::blocked_range<size_t>(0, chrSize_[chr]), [&](const tbb::blocked_range<size_t> & range)
+				{
+					for (size_t idx = range.begin(); idx != range.end(); idx++)
+					{
+						size_t absId = abs(position_[chr][idx].id);
+						size_t o = vertex_.begin[absId] + occurrence[absId].fetch_add(1, std::memory_order_relaxed);
+						vertex_.chr[o] = uint32_t(chr);
+						vertex_.idx[o] = Offset(idx);
+					}
+				});
+			}
+
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, vertices), [&](const tbb::blocked_range<size_t> & range)
+			{
+				std::vector<std::pair<uint32_t, Offset> > genomeOrder;
+				for (size_t i = range.begin(); i != range.end(); i++)
+				{
+					genomeOrder.clear();
+					for (size_t o = vertex_.begin[i]; o < vertex_.begin[i + 1]; o++)
+					{
+						genomeOrder.push_back(std::make_pair(vertex_.chr[o], vertex_.idx[o]));
+					}
+
+					if (!std::is_sorted(genomeOrder.begin(), genomeOrder.end()))
+					{
+						std::sort(genomeOrder.begin(), genomeOrder.end());
+					}
+
+					for (size_t o = vertex_.begin[i], j = 0; o < vertex_.begin[i + 1]; o++, j++)
+					{
+						const Position & now = position_[genomeOrder[j].first][genomeOrder[j].second];
+						vertex_.chr[o] = genomeOrder[j].first;
+						vertex_.idx[o] = genomeOrder[j].second;
+						vertex_.pos[o] = now.pos;
+						vertex_.positive[o] = now.id > 0;
+					}
+				}
+			});
+		}
+
+		static const size_t JUNCTION_RECORD_SIZE = sizeof(uint32_t) * 2 + sizeof(int64_t);
+		static const size_t JUNCTION_BATCH_SIZE = size_t(1) << 16;
+		static const size_t JUNCTION_QUEUE_CAPACITY = 16;
+		static const uint32_t COMPACT_BLOCK_SIZE = 1 << 12;
+		static const uint64_t COMPACT_VERSION = 1;
+		static const size_t ESTIMATE_SAMPLE_SIZE = size_t(1) << 16;
+
+		static void DecodeJunction(const char * record, uint32_t & chr, RawJunction & junction)
+		{
+			int64_t id;
+			uint32_t pos;
+			memcpy(&chr, record, sizeof(chr));
+			memcpy(&pos, record + sizeof(chr), sizeof(pos));
+			memcpy(&id, record + sizeof(chr) + sizeof(pos), sizeof(id));
+			junction.id = static_cast<int32_t>(id);
+			junction.pos = pos;
+		}
+
+		static void EncodeVarint(uint64_t value, std::string & out)
+		{
+			for (; value >= 0x80; value >>= 7)
+			{
+				out.push_back(char(value | 0x80));
+			}
+
+			out.push_back(char(value));
+		}
+
+		//Values of the compact format never take more than 5 bytes, so whenever 8 bytes are
+		//left the terminating byte is found with one bit scan and the 7-bit groups are packed
+		//with shifts and masks instead of a loop over the bytes
+		static uint64_t DecodeVarint(const uint8_t *& p, const uint8_t * end)
+		{
+			uint64_t word;
+			if (end - p >= int64_t(sizeof(word)))
+			{
+				memcpy(&word, p, sizeof(word));
+				uint64_t stop = ~word & 0x8080808080808080ULL;
+				if (stop != 0)
+				{
+					size_t bits = __builtin_ctzll(stop) + 1;
+					word &= (bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1) & 0x7F7F7F7F7F7F7F7FULL;
+					word = (word & 0x007F007F007F007FULL) | ((word & 0x7F007F007F007F00ULL) >> 1);
+					word = (word & 0x00003FFF00003FFFULL) | ((word & 0x3FFF00003FFF0000ULL) >> 2);
+					word = (word & 0x000000000FFFFFFFULL) | ((word & 0x0FFFFFFF00000000ULL) >> 4);
+					p += bits / 8;
+					return word;
+				}
+			}
+
+			uint64_t ret = 0;
+			for (size_t shift = 0; p < end; shift += 7)
+			{
+				uint8_t byte = *p++;
+				ret |= uint64_t(byte & 0x7F) << shift;
+				if ((byte & 0x80) == 0)
+				{
+					return ret;
+				}
+			}
+
+			throw std::runtime_error("Truncated block in the junction file");
+		}
+
+		//Loads a file written by CompactJunctions. Returns false if the file is not in the
+		//compact format. The blocks do not depend on each other and are decoded in parallel
+		//straight into their places in the per-chromosome vectors. A sample is taken from the
+		//blocks one after another, like ReadJunctions does, skipping the blocks past the sample
+		bool LoadCompactJunctions(const std::string & inFileName, uint64_t sampleLength, std::vector<RawJunctionVector> & junction, std::vector<uint32_t> & abundance)
+		{
+			MappedFile file;
+			CompactHeader header;
+			if (!file.Open(inFileName) || file.GetSize() < sizeof(header))
+			{
+				return false;
+			}
+
+			memcpy(&header, file.GetData(), sizeof(header));
+			if (memcmp(header.magic, CompactMagic(), sizeof(header.magic)) != 0)
+			{
+				return false;
+			}
+
+			if (header.version != COMPACT_VERSION || header.indexOffset + header.blockNumber * sizeof(CompactBlock) != file.GetSize())
+			{
+				throw std::runtime_error("Incompatible junction file " + inFileName);
+			}
+
+			const uint8_t * data = reinterpret_cast<const uint8_t*>(file.GetData());
+			std::vector<CompactBlock> block(header.blockNumber);
+			std::vector<size_t> start(header.blockNumber);
+			std::vector<size_t> chrSize;
+			memcpy(block.data(), data + header.indexOffset, block.size() * sizeof(CompactBlock));
+			for (size_t b = 0; b < block.size(); b++)
+			{
+				if (block[b].offset + block[b].size > header.indexOffset)
+				{
+					throw std::runtime_error("Incompatible junction file " + inFileName);
+				}
+
+				if (block[b].chr >= chrSize.size())
+				{
+					chrSize.resize(block[b].chr + 1, 0);
+				}
+
+				start[b] = chrSize[block[b].chr];
+				chrSize[block[b].chr] += block[b].count;
+			}
+
+			std::unique_ptr<std::atomic<uint32_t>[]> count(new std::atomic<uint32_t>[header.maxId + 1]);
+			for (size_t i = 0; i <= header.maxId; i++)
+			{
+				count[i].store(0, std::memory_order_relaxed);
+			}
+
+			junction.resize(chrSize.size());
+			if (sampleLength > 0)
+			{
+				std::vector<bool> sampled(chrSize.size(), true);
+				for (size_t b = 0; b < block.size(); b++)
+				{
+					if (!sampled[block[b].chr] || block[b].basePos >= sampleLength)
+					{
+						sampled[block[b].chr] = false;
+						continue;
+					}
+
+					DecodeCompactBlock(data, block[b], header.maxId, [&](const RawJunction & now)
+					{
+						sampled[block[b].chr] = sampled[block[b].chr] && now.pos < sampleLength;
+						if (sampled[block[b].chr])
+						{
+							count[abs(now.id)].fetch_add(1, std::memory_order_relaxed);
+							junction[block[b].chr].push_back(now);
+						}
+					});
+				}
+			}
+			else
+			{
+				for (size_t chr = 0; chr < chrSize.size(); chr++)
+				{
+					junction[chr].resize(chrSize[chr]);
+				}
+
+				tbb::parallel_for(tbb::blocked_range<size_t>(0, block.size(), 1), [&](const tbb::blocked_range<size_t> & range)
+				{
+					for (size_t b = range.begin(); b != range.end(); b++)
+					{
+						RawJunction * out = junction[block[b].chr].data() + start[b];
+						DecodeCompactBlock(data, block[b], header.maxId, [&](const RawJunction & now)
+						{
+							*out++ = now;
+							count[abs(now.id)].fetch_add(1, std::memory_order_relaxed);
+						});
+					}
+				});
+			}
+
+			abundance.resize(header.maxId + 1);
+			for (size_t i = 0; i <= header.maxId; i++)
+			{
+				abundance[i] = count[i].load(std::memory_order_relaxed);
+			}
+
+			return true;
+		}
+
+		struct JunctionSegment
+		{
+			uint32_t chr;
+			size_t offset;
+			size_t count;
+		};
+
+		struct JunctionChunk
+		{
+			size_t begin;
+			size_t end;
+			bool sorted;
+			uint32_t firstChr;
+			uint32_t lastChr;
+			size_t maxId;
+			std::vector<JunctionSegment> segment;
+
+			JunctionChunk(size_t begin, size_t end) : begin(begin), end(end), sorted(true), firstChr(0), lastChr(0), maxId(0)
+			{
+
+			}
+		};
+
+		//Abundances of the ids below a bound known before the file is read. The counters live in
+		//pages allocated when an id in them is met first, so the memory taken follows the largest
+		//id rather than the bound
+		class AbundanceCounter
+		{
+		public:
+			AbundanceCounter(size_t bound) : pages_((bound >> PAGE_BITS) + 1), page_(new std::atomic<std::atomic<uint32_t>*>[pages_])
+			{
+				for (size_t i = 0; i < pages_; i++)
+				{
+					page_[i].store(0, std::memory_order_relaxed);
+				}
+			}
+
+			~AbundanceCounter()
+			{
+				for (size_t i = 0; i < pages_; i++)
+				{
+					delete[] page_[i].load(std::memory_order_relaxed);
+				}
+			}
+
+			size_t GetBound() const
+			{
+				return pages_ << PAGE_BITS;
+			}
+
+			void Add(size_t id)
+			{
+				std::atomic<std::atomic<uint32_t>*> & slot = page_[id >> PAGE_BITS];
+				std::atomic<uint32_t> * page = slot.load(std::memory_order_acquire);
+				if (page == 0)
+				{
+					std::atomic<uint32_t> * fresh = new std::atomic<uint32_t>[size_t(1) << PAGE_BITS];
+					for (size_t i = 0; i < (size_t(1) << PAGE_BITS); i++)
+					{
+						fresh[i].store(0, std::memory_order_relaxed);
+					}
+
+					if (slot.compare_exchange_strong(page, fresh, std::memory_order_acq_rel))
+					{
+						page = fresh;
+					}
+					else
+					{
+						delete[] fresh;
+					}
+				}
+
+				page[id & ((size_t(1) << PAGE_BITS) - 1)].fetch_add(1, std::memory_order_relaxed);
+			}
+
+			uint32_t operator[](size_t id) const
+			{
+				const std::atomic<uint32_t> * page = page_[id >> PAGE_BITS].load(std::memory_order_acquire);
+				return page != 0 ? page[id & ((size_t(1) << PAGE_BITS) - 1)].load(std::memory_order_relaxed) : 0;
+			}
+
+		private:
+			AbundanceCounter(const AbundanceCounter &);
+			AbundanceCounter & operator = (const AbundanceCounter &);
+
+			static const size_t PAGE_BITS = 16;
+
+			size_t pages_;
+			std::unique_ptr<std::atomic<std::atomic<uint32_t>*>[]> page_;
+		};
+
+		template<class F>
+		void ForEachKeptJunction(const char * data,
+			const JunctionChunk & chunk,
+			const AbundanceCounter & abundance,
+			int64_t abundanceThreshold,
+			int64_t loopThreshold,
+			F f) const
+		{
+			uint32_t chr;
+			RawJunction now;
+			Buffer buffer(loopThreshold);
+			size_t start = chunk.begin;
+			DecodeJunction(data + chunk.begin * JUNCTION_RECORD_SIZE, chr, now);
+			for (uint32_t prevChr; start > 0; start--)
+			{
+				RawJunction prev;
+				DecodeJunction(data + (start - 1) * JUNCTION_RECORD_SIZE, prevChr, prev);
+				if (prevChr != chr || int64_t(now.pos) - int64_t(prev.pos) >= loopThreshold)
+				{
+					break;
+				}
+			}
+
+			for (size_t i = start; i < chunk.begin; i++)
+			{
+				DecodeJunction(data + i * JUNCTION_RECORD_SIZE, chr, now);
+				if (abundance[abs(now.id)] < size_t(abundanceThreshold))
+				{
+					buffer.AddAndCheck(chr, now);
+				}
+			}
+
+			for (size_t i = chunk.begin; i < chunk.end; i++)
+			{
+				DecodeJunction(data + i * JUNCTION_RECORD_SIZE, chr, now);
+				if (abundance[abs(now.id)] < size_t(abundanceThreshold) && buffer.AddAndCheck(chr, now))
+				{
+					f(chr, now);
+				}
+			}
+		}
+
+		//Decodes a regular .dbg file mapped into memory in parallel chunks. Returns false if the
+		//file cannot be mapped, does not look like a sorted junction stream or has ids above the
+		//number of its records, in which case the streaming loader is used instead
+		//A raw junction file has no header, so it is recognized by its size and by the first
+		//record, which has to match what the TwoPaCo reader decodes from the same file
+		static bool IsJunctionFile(const std::string & inFileName, const MappedFile & file)
+		{
+			if (file.GetSize() % JUNCTION_RECORD_SIZE != 0)
+			{
+				return false;
+			}
+
+			if (file.GetSize() > 0)
+			{
+				uint32_t chr;
+				RawJunction now;
+				TwoPaCo::JunctionPosition first;
+				TwoPaCo::JunctionPositionReader reader(inFileName);
+				DecodeJunction(file.GetData(), chr, now);
+				if (!reader.NextJunctionPosition(first) || first.GetChr() != chr || first.GetPos() != now.pos || first.GetId() != now.id)
+				{
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		//Reads the sample of a mapped junction file without touching the rest of it. The records
+		//are sorted by chromosome, so after the junctions in the first sampleLength bases of a
+		//chromosome the first record of the next one is found by a binary search
+		bool LoadMappedSample(const std::string & inFileName, uint64_t sampleLength, std::vector<RawJunctionVector> & junction, std::vector<uint32_t> & abundance)
+		{
+			MappedFile file;
+			if (!file.Open(inFileName) || !IsJunctionFile(inFileName, file))
+			{
+				return false;
+			}
+
+			const char * data = file.GetData();
+			size_t records = file.GetSize() / JUNCTION_RECORD_SIZE;
+			for (size_t begin = 0; begin < records;)
+			{
+				uint32_t chr;
+				uint32_t nowChr;
+				RawJunction now;
+				DecodeJunction(data + begin * JUNCTION_RECORD_SIZE, chr, now);
+				junction.resize(max(junction.size(), size_t(chr) + 1));
+				size_t end = begin;
+				for (; end < records; end++)
+				{
+					DecodeJunction(data + end * JUNCTION_RECORD_SIZE, nowChr, now);
+					if (nowChr != chr || now.pos >= sampleLength)
+					{
+						break;
+					}
+
+					size_t absId = abs(now.id);
+					if (absId >= abundance.size())
+					{
+						abundance.resize(absId + 1, 0);
+					}
+
+					++abundance[absId];
+					junction[chr].push_back(now);
+				}
+
+				for (size_t last = records; end < last;)
+				{
+					size_t middle = end + (last - end) / 2;
+					DecodeJunction(data + middle * JUNCTION_RECORD_SIZE, nowChr, now);
+					if (nowChr <= chr)
+					{
+						end = middle + 1;
+					}
+					else
+					{
+						last = middle;
+					}
+				}
+
+				begin = max(end, begin + 1);
+			}
+
+			return true;
+		}
+
+		bool LoadMappedJunctions(const std::string & inFileName, int64_t threads, int64_t abundanceThreshold, int64_t loopThreshold)
+		{
+			MappedFile file;
+			if (!file.Open(inFileName) || !IsJunctionFile(inFileName, file))
+			{
+				return false;
+			}
+
+			const char * data = file.GetData();
+			size_t records = file.GetSize() / JUNCTION_RECORD_SIZE;
+
+			std::vector<JunctionChunk> chunk;
+			size_t chunkSize = max(size_t(1) << 16, records / (max(threads, int64_t(1)) * 16) + 1);
+			for (size_t begin = 0; begin < records; begin += chunkSize)
+			{
+				chunk.push_back(JunctionChunk(begin, min(records, begin + chunkSize)));
+			}
+
+			//The order check, the largest id and the abundances come from one pass, so a file
+			//larger than the memory is faulted in once before the positions are filled
+			AbundanceCounter abundance(records);
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, chunk.size(), 1), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t c = range.begin(); c != range.end(); c++)
+				{
+					uint32_t chr;
+					RawJunction now;
+					DecodeJunction(data + chunk[c].begin * JUNCTION_RECORD_SIZE, chunk[c].firstChr, now);
+					chunk[c].lastChr = chunk[c].firstChr;
+					for (size_t i = chunk[c].begin; i < chunk[c].end && chunk[c].sorted; i++)
+					{
+						DecodeJunction(data + i * JUNCTION_RECORD_SIZE, chr, now);
+						size_t absId = abs(now.id);
+						chunk[c].sorted = chr >= chunk[c].lastChr && absId < abundance.GetBound();
+						chunk[c].maxId = max(chunk[c].maxId, absId);
+						chunk[c].lastChr = chr;
+						if (chunk[c].sorted)
+						{
+							abundance.Add(absId);
+						}
+					}
+				}
+			});
+
+			size_t vertices = 1;
+			size_t chromosomes = 0;
+			for (size_t c = 0; c < chunk.size(); c++)
+			{
+				if (!chunk[c].sorted || (c > 0 && chunk[c].firstChr < chunk[c - 1].lastChr))
+				{
+					return false;
+				}
+
+				vertices = max(vertices, chunk[c].maxId + 1);
+				chromosomes = chunk[c].lastChr + 1;
+			}
+
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, chunk.size(), 1), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t c = range.begin(); c != range.end(); c++)
+				{
+					auto & segment = chunk[c].segment;
+					ForEachKeptJunction(data, chunk[c], abundance, abundanceThreshold, loopThreshold, [&](uint32_t chr, const RawJunction &)
+					{
+						if (segment.empty() || segment.back().chr != chr)
+						{
+							JunctionSegment next = { chr, 0, 0 };
+							segment.push_back(next);
+						}
+
+						segment.back().count++;
+					});
+				}
+			});
+
+			chrSize_.assign(chromosomes, 0);
+			for (auto & c : chunk)
+			{
+				for (auto & segment : c.segment)
+				{
+					segment.offset = chrSize_[segment.chr];
+					chrSize_[segment.chr] += segment.count;
+				}
+			}
+
+			AllocatePositions();
+
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, chunk.size(), 1), [&](const tbb::blocked_range<size_t> & range)
+			{
+				for (size_t c = range.begin(); c != range.end(); c++)
+				{
+					auto segment = chunk[c].segment.begin();
+					size_t idx = segment != chunk[c].segment.end() ? segment->offset : 0;
+					ForEachKeptJunction(data, chunk[c], abundance, abundanceThreshold, loopThreshold, [&](uint32_t chr, const RawJunction & now)
+					{
+						if (segment->chr != chr)
+						{
+							idx = (++segment)->offset;
+						}
+
+						position_[chr][idx++].Assign(now.id, now.pos);
+					});
+				}
+			});
+
+			UnwrapPositions();
+			BuildVertexTable(RenumberVertices(vertices));
+			return true;
+		}
+
+		struct LightEdge
+		{
+			int64_t vertex;
+			char ch;
+		};
+
+		static int64_t GetMutexBits(int64_t threads)
+		{
+			int64_t ret = 3;
+			for (; (int64_t(1) << ret) < threads * (1 << 10); ret++);
+			return ret;
+		}
+
+		//One lock table for all chromosomes: the stripes of a chromosome follow the ones of the
+		//previous chromosome, so the locks are still taken in the order of the instances
+		size_t MutexIdx(size_t chrId, size_t idx) const
+		{
+			size_t ret = chrMutexStart_[chrId] + (idx >> chrMutexBits_[chrId]);
+			assert(ret < MutexNumber());
+			return ret;
+		}
+
+		struct CompactHeader
+		{
+			char magic[8];
+			uint64_t version;
+			uint64_t records;
+			uint64_t maxId;
+			uint64_t blockNumber;
+			uint64_t indexOffset;
+		};
+
+		struct CompactBlock
+		{
+			uint64_t offset;
+			uint64_t size;
+			uint32_t chr;
+			uint32_t count;
+			uint32_t basePos;
+			uint32_t reserved;
+		};
+
+		static const char * CompactMagic()
+		{
+			return "SIBZJNC";
+		}
+
+		template<class F>
+		static void DecodeCompactBlock(const uint8_t * data, const CompactBlock & block, uint64_t maxId, F f)
+		{
+			RawJunction now;
+			uint32_t pos = block.basePos;
+			const uint8_t * p = data + block.offset;
+			const uint8_t * end = p + block.size;
+			for (size_t i = 0; i < block.count; i++)
+			{
+				pos += static_cast<uint32_t>(DecodeVarint(p, end));
+				uint64_t id = DecodeVarint(p, end);
+				now.id = static_cast<int32_t>(int64_t(id >> 1) ^ -int64_t(id & 1));
+				now.pos = pos;
+				if (size_t(abs(now.id)) > maxId)
+				{
+					throw std::runtime_error("Corrupted block in the junction file");
+				}
+
+				f(now);
+			}
+
+			if (p != end)
+			{
+				throw std::runtime_error("Corrupted block in the junction file");
+			}
+		}
+
+		struct IndexHeader
+		{
+			char magic[8];
+			uint64_t version;
+			uint64_t k;
+			uint64_t abundanceThreshold;
+			uint64_t loopThreshold;
+			uint64_t positionSize;
+			uint64_t chrNumber;
+			uint64_t vertexNumber;
+			uint64_t positionNumber;
+			uint64_t edgeNumber;
+			uint64_t chrSizeOffset;
+			uint64_t positionOffset;
+			uint64_t vertexOffset;
+			uint64_t edgeBeginOffset;
+			uint64_t edgeOffset;
+			uint64_t usedOffset;
+			uint64_t sequenceIndexOffset;
+			uint64_t sequenceOffset;
+			uint64_t descriptionIndexOffset;
+			uint64_t descriptionOffset;
+			uint64_t fileSize;
+		};
+
+		static const size_t RENUMBER_BLOCK = size_t(1) << 16;
+		static const uint64_t INDEX_VERSION = 4;
+		static const size_t INDEX_ALIGNMENT = 4096;
+		static const size_t INDEX_SEQUENCE_BLOCK = size_t(1) << 24;
+		static const int64_t MIN_CHR_STRIPE_BITS = 3;
+
+		static const char * IndexMagic()
+		{
+			return "SIBZIDX";
+		}
+
+		static size_t IndexAlign(size_t offset)
+		{
+			return (offset + INDEX_ALIGNMENT - 1) / INDEX_ALIGNMENT * INDEX_ALIGNMENT;
+		}
+
+		//Outgoing edge of the vertex owning its row in edge_
+		struct AdjacentEdge
+		{
+			int32_t endVertex;
+			Offset length;
+			uint32_t capacity;
+			char ch;
+			char revCh;
+		};
+
+		struct JunctionChar
+		{
+			char following;
+			char preceding;
+		};
+
 		struct FlaggedMutex
 		{
 			FlaggedMutex() 
@@ -894,18 +2604,31 @@ namespace Sibelia
 		};
 
 		int64_t k_;
-		int64_t mutexBits_;
+		bool junctionOnly_;
+		bool outOfCore_;
+		int64_t abundanceThreshold_;
+		int64_t loopThreshold_;
 		std::map<std::string, size_t> sequenceId_;
-		std::vector<std::vector<Edge> > ingoingEdge_;
-		std::vector<std::vector<Edge> > outgoingEdge_;
-		std::vector<std::string> sequence_;
-		std::vector<std::string> sequenceDescription_;		
-		std::vector<int64_t> chrSizeBits_;
+		const uint64_t * edgeBegin_;
+		const AdjacentEdge * edge_;
+		LargeArray<uint64_t> edgeBeginBuffer_;
+		LargeArray<AdjacentEdge> edgeBuffer_;
+		SequenceStorage sequence_;
+		std::vector<int64_t> chrMutexBits_;
+		std::vector<size_t> chrMutexStart_;
 		std::vector<size_t> chrSize_;
-		std::vector<VertexVector> vertex_;
-		std::vector<std::unique_ptr<Position[]> > position_;
-		std::vector<std::unique_ptr<FlaggedMutex[]> > mutex_;
-		static JunctionStorage * this_;
+		std::vector<size_t> chrStart_;
+		size_t vertexNumber_;
+		size_t sampleVertexNumber_;
+		size_t streamVertexNumber_;
+		VertexTable vertex_;
+		LargeArray<uint64_t> vertexBuffer_;
+		MappedFile index_;
+		std::vector<Position*> position_;
+		LargeArray<Position> positionBuffer_;
+		mutable AtomicBitset used_;
+		LargeArray<JunctionChar> junctionChar_;
+		std::unique_ptr<FlaggedMutex[]> mutex_;
 	};
 }
 
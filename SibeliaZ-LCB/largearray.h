@@ -0,0 +1,166 @@
+#ifndef _LARGE_ARRAY_H_
+#define _LARGE_ARRAY_H_
+
+#include <new>
+#include <memory>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+#include <sys/mman.h>
+
+namespace Sibelia
+{
+	//Process-wide switch, arrays allocated before it is changed keep their memory
+	inline bool & HugePages()
+	{
+		static bool hugePages = false;
+		return hugePages;
+	}
+
+	//Array for the big tables that are looked up at random: positions, vertices, edges,
+	//block assignments and distances. With huge pages on, every array is a separate
+	//anonymous mapping aligned to 2 MB. It is taken from the reserved huge pages if there
+	//are any and is advised to be backed by transparent huge pages otherwise, so a lookup
+	//misses the TLB far less often. The elements must not need destructors
+	template<class T>
+	class LargeArray
+	{
+	public:
+		LargeArray() : data_(0), size_(0), mapped_(0)
+		{
+
+		}
+
+		~LargeArray()
+		{
+			Release();
+		}
+
+		//The elements are left uninitialized
+		void Allocate(size_t size)
+		{
+			Release();
+			size_t bytes = size * sizeof(T);
+			if (bytes == 0)
+			{
+				return;
+			}
+
+			if (HugePages())
+			{
+				data_ = static_cast<T*>(MapHuge(bytes));
+			}
+			else
+			{
+				data_ = static_cast<T*>(::operator new(bytes));
+			}
+
+			size_ = size;
+		}
+
+		void Assign(size_t size, const T & value)
+		{
+			Allocate(size);
+			std::uninitialized_fill(data_, data_ + size_, value);
+		}
+
+		void Release()
+		{
+			if (mapped_ > 0)
+			{
+				munmap(data_, mapped_);
+			}
+			else
+			{
+				::operator delete(data_);
+			}
+
+			data_ = 0;
+			size_ = mapped_ = 0;
+		}
+
+		void Swap(LargeArray & other)
+		{
+			std::swap(data_, other.data_);
+			std::swap(size_, other.size_);
+			std::swap(mapped_, other.mapped_);
+		}
+
+		T & operator[](size_t idx)
+		{
+			return data_[idx];
+		}
+
+		const T & operator[](size_t idx) const
+		{
+			return data_[idx];
+		}
+
+		T * GetData()
+		{
+			return data_;
+		}
+
+		const T * GetData() const
+		{
+			return data_;
+		}
+
+		size_t GetSize() const
+		{
+			return size_;
+		}
+
+		//Bytes taken, including the rounding up to a huge page
+		size_t GetMemoryUsage() const
+		{
+			return mapped_ > 0 ? mapped_ : size_ * sizeof(T);
+		}
+
+	private:
+		LargeArray(const LargeArray &);
+		LargeArray & operator = (const LargeArray &);
+
+		static const size_t HUGE_PAGE_SIZE = size_t(1) << 21;
+
+		void * MapHuge(size_t bytes)
+		{
+			mapped_ = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+			void * ret = MAP_FAILED;
+#ifdef MAP_HUGETLB
+			ret = mmap(0, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+			if (ret == MAP_FAILED)
+			{
+				//Map a page more than needed and trim it so the array starts on a huge page boundary
+				char * start = static_cast<char*>(mmap(0, mapped_ + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+				if (start == MAP_FAILED)
+				{
+					mapped_ = 0;
+					throw std::bad_alloc();
+				}
+
+				char * aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(start) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+				if (aligned > start)
+				{
+					munmap(start, aligned - start);
+				}
+
+				munmap(aligned + mapped_, start + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+				madvise(aligned, mapped_, MADV_HUGEPAGE);
+#endif
+				ret = aligned;
+			}
+
+			return ret;
+		}
+
+		T * data_;
+		size_t size_;
+		size_t mapped_;
+	};
+}
+
+#endif
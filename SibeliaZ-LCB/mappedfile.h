@@ -0,0 +1,118 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <string>
+#include <cstdint>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace Sibelia
+{
+	using std::min;
+
+	class MappedFile
+	{
+	public:
+		MappedFile() : data_(0), size_(0)
+		{
+
+		}
+
+		~MappedFile()
+		{
+			Close();
+		}
+
+		//A writable mapping is private: writes stay in the process and never reach the file
+		bool Open(const std::string & fileName, bool writable = false)
+		{
+			Close();
+			//Opening a FIFO would block until a writer shows up and steal its data, so
+			//anything but a regular file is rejected before it is opened
+			struct stat info;
+			if (stat(fileName.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+			{
+				return false;
+			}
+
+			int fd = open(fileName.c_str(), O_RDONLY);
+			if (fd == -1)
+			{
+				return false;
+			}
+
+			if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+			{
+				close(fd);
+				return false;
+			}
+
+			size_ = size_t(info.st_size);
+			if (size_ > 0)
+			{
+				void * data = mmap(0, size_, writable ? PROT_READ | PROT_WRITE : PROT_READ, writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+				if (data == MAP_FAILED)
+				{
+					size_ = 0;
+					close(fd);
+					return false;
+				}
+
+				data_ = static_cast<char*>(data);
+			}
+
+			close(fd);
+			return true;
+		}
+
+		void Close()
+		{
+			if (data_ != 0)
+			{
+				munmap(data_, size_);
+			}
+
+			data_ = 0;
+			size_ = 0;
+		}
+
+		const char * GetData() const
+		{
+			return data_;
+		}
+
+		char * GetData()
+		{
+			return data_;
+		}
+
+		size_t GetSize() const
+		{
+			return size_;
+		}
+
+		//Passes an access pattern hint for the bytes [offset, offset + size) to the kernel
+		void Advise(size_t offset, size_t size, int advice) const
+		{
+			size_t page = size_t(sysconf(_SC_PAGESIZE));
+			size_t start = offset / page * page;
+			if (data_ != 0 && start < size_)
+			{
+				madvise(data_ + start, min(size_, offset + size) - start, advice);
+			}
+		}
+
+	private:
+		MappedFile(const MappedFile &);
+		MappedFile& operator = (const MappedFile &);
+
+		char * data_;
+		size_t size_;
+	};
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef _PACKED_SEQUENCE_H_
+#define _PACKED_SEQUENCE_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include <dnachar.h>
+
+namespace Sibelia
+{
+	//Nucleotide sequence with 2 bits per base. Characters other than A, C, G and T are
+	//stored as runs in a separate exception list, which is tiny for assembled genomes
+	class PackedSequence
+	{
+	public:
+		PackedSequence() : length_(0)
+		{
+
+		}
+
+		void PushBack(char ch)
+		{
+			uint64_t code = Code(ch);
+			if (length_ % BASES_PER_WORD == 0)
+			{
+				word_.push_back(0);
+			}
+
+			if (code == NOT_A_BASE)
+			{
+				if (exception_.empty() || exception_.back().ch != ch || exception_.back().start + exception_.back().length != length_)
+				{
+					Exception now = { length_, 0, ch };
+					exception_.push_back(now);
+				}
+
+				exception_.back().length++;
+				code = 0;
+			}
+
+			word_.back() |= code << (BIT_PER_BASE * (length_ % BASES_PER_WORD));
+			length_++;
+		}
+
+		void ShrinkToFit()
+		{
+			std::vector<uint64_t>(word_).swap(word_);
+			std::vector<Exception>(exception_).swap(exception_);
+		}
+
+		size_t GetLength() const
+		{
+			return length_;
+		}
+
+		size_t GetMemoryUsage() const
+		{
+			return word_.capacity() * sizeof(word_[0]) + exception_.capacity() * sizeof(Exception);
+		}
+
+		char GetChar(size_t pos) const
+		{
+			if (!exception_.empty())
+			{
+				auto it = std::upper_bound(exception_.begin(), exception_.end(), pos, Exception::StartLess);
+				if (it != exception_.begin() && (--it)->start + it->length > pos)
+				{
+					return it->ch;
+				}
+			}
+
+			return Literal(GetCode(pos));
+		}
+
+		void Extract(size_t start, size_t length, bool reverse, std::string & out) const
+		{
+			out.resize(length);
+			size_t end = start + length;
+			if (!reverse)
+			{
+				size_t i = start;
+				for (; i < end && i % BASES_PER_WORD != 0; i++)
+				{
+					out[i - start] = Literal(GetCode(i));
+				}
+
+				for (; i + BASES_PER_WORD <= end; i += BASES_PER_WORD)
+				{
+					DecodeWord(word_[i / BASES_PER_WORD], &out[i - start]);
+				}
+
+				for (; i < end; i++)
+				{
+					out[i - start] = Literal(GetCode(i));
+				}
+			}
+			else
+			{
+				size_t i = end;
+				size_t j = 0;
+				for (; i > start && i % BASES_PER_WORD != 0; i--, j++)
+				{
+					out[j] = Literal(GetCode(i - 1) ^ COMPLEMENT_MASK);
+				}
+
+				for (; i >= start + BASES_PER_WORD; i -= BASES_PER_WORD, j += BASES_PER_WORD)
+				{
+					DecodeWord(ReverseComplement(word_[i / BASES_PER_WORD - 1]), &out[j]);
+				}
+
+				for (; i > start; i--, j++)
+				{
+					out[j] = Literal(GetCode(i - 1) ^ COMPLEMENT_MASK);
+				}
+			}
+
+			auto it = std::upper_bound(exception_.begin(), exception_.end(), start, Exception::StartLess);
+			if (it != exception_.begin())
+			{
+				--it;
+			}
+
+			for (; it != exception_.end() && it->start < end; ++it)
+			{
+				size_t from = std::max(start, it->start);
+				size_t to = std::min(end, it->start + it->length);
+				for (size_t pos = from; pos < to; pos++)
+				{
+					if (!reverse)
+					{
+						out[pos - start] = it->ch;
+					}
+					else
+					{
+						out[end - pos - 1] = TwoPaCo::DnaChar::ReverseChar(it->ch);
+					}
+				}
+			}
+		}
+
+	private:
+
+		struct Exception
+		{
+			size_t start;
+			size_t length;
+			char ch;
+
+			static bool StartLess(size_t pos, const Exception & exception)
+			{
+				return pos < exception.start;
+			}
+		};
+
+		static const uint64_t BIT_PER_BASE = 2;
+		static const uint64_t BASES_PER_WORD = 32;
+		static const uint64_t BASE_MASK = 3;
+		static const uint64_t COMPLEMENT_MASK = 3;
+		static const uint64_t NOT_A_BASE = 4;
+
+		static char Literal(uint64_t code)
+		{
+			return "ACGT"[code];
+		}
+
+		static uint64_t Code(char ch)
+		{
+			switch (ch)
+			{
+			case 'A':
+				return 0;
+			case 'C':
+				return 1;
+			case 'G':
+				return 2;
+			case 'T':
+				return 3;
+			}
+
+			return NOT_A_BASE;
+		}
+
+		uint64_t GetCode(size_t pos) const
+		{
+			return (word_[pos / BASES_PER_WORD] >> (BIT_PER_BASE * (pos % BASES_PER_WORD))) & BASE_MASK;
+		}
+
+		static void DecodeWord(uint64_t word, char * out)
+		{
+			for (size_t i = 0; i < BASES_PER_WORD; i++, word >>= BIT_PER_BASE)
+			{
+				out[i] = Literal(word & BASE_MASK);
+			}
+		}
+
+		//Complements all 32 bases of the word and reverses their order
+		static uint64_t ReverseComplement(uint64_t word)
+		{
+			word = ~word;
+			word = ((word >> 2) & 0x3333333333333333ULL) | ((word & 0x3333333333333333ULL) << 2);
+			word = ((word >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((word & 0x0F0F0F0F0F0F0F0FULL) << 4);
+			word = ((word >> 8) & 0x00FF00FF00FF00FFULL) | ((word & 0x00FF00FF00FF00FFULL) << 8);
+			word = ((word >> 16) & 0x0000FFFF0000FFFFULL) | ((word & 0x0000FFFF0000FFFFULL) << 16);
+			return (word >> 32) | (word << 32);
+		}
+
+		size_t length_;
+		std::vector<uint64_t> word_;
+		std::vector<Exception> exception_;
+	};
+}
+
+#endif
@@ -1,9 +1,10 @@
 #ifndef _PATH_H_
 #define _PATH_H_
 
-#include <set>
 #include <cassert>
 #include <algorithm>
+#include "arena.h"
+#include "flatmultiset.h"
 #include "distancekeeper.h"
 
 
@@ -38,14 +39,17 @@ namespace Sibelia
 			int64_t maxBranchSize,
 			int64_t minBlockSize,
 			int64_t minScoringUnit,
-			int64_t maxFlankingSize) :
+			int64_t maxFlankingSize,
+			Arena * arena = 0) :
+			leftBody_(ArenaAllocator<Point>(arena)),
+			rightBody_(ArenaAllocator<Point>(arena)),
+			allInstance_(ArenaAllocator<InstanceSet::iterator>(arena)),
+			goodInstance_(ArenaAllocator<InstanceSet::iterator>(arena)),
 			maxBranchSize_(maxBranchSize),
 			minBlockSize_(minBlockSize),
 			minScoringUnit_(minScoringUnit),
 			maxFlankingSize_(maxFlankingSize),
-			storage_(&storage),
-			distanceKeeper_(storage.GetVerticesNumber()),
-			instance_(storage.GetChrNumber())
+			storage_(&storage)
 		{
 
 		}
@@ -55,11 +59,11 @@ namespace Sibelia
 			origin_ = vid;
 			distanceKeeper_.Set(vid, 0);
 			leftBodyFlank_ = rightBodyFlank_ = 0;
-			for (JunctionStorage::JunctionIterator it(vid); it.Valid(); ++it)
+			for (JunctionStorage::JunctionIterator it(*storage_, vid); it.Valid(); ++it)
 			{
 				if (!it.IsUsed())
 				{
-					allInstance_.push_back(instance_[it.GetChrId()].insert(Instance(it.SequentialIterator(), 0)));
+					allInstance_.push_back(instance_.insert(Instance(it.SequentialIterator(), 0)));
 				}
 			}
 		}
@@ -100,7 +104,7 @@ namespace Sibelia
 				back_(it),
 				frontDistance_(distance),
 				backDistance_(distance),
-				compareIdx_(it.GetIndex())
+				compareIdx_(it.GetGlobalIndex())
 			{
 
 			}
@@ -112,7 +116,7 @@ namespace Sibelia
 				assert(backDistance_ >= frontDistance_);
 				if (!back_.IsPositiveStrand())
 				{
-					compareIdx_ = front_.GetIndex();
+					compareIdx_ = front_.GetGlobalIndex();
 				}
 			}
 
@@ -123,7 +127,7 @@ namespace Sibelia
 				assert(backDistance_ >= frontDistance_);
 				if (back_.IsPositiveStrand())
 				{
-					compareIdx_ = back_.GetIndex();
+					compareIdx_ = back_.GetGlobalIndex();
 				}
 			}
 
@@ -166,7 +170,7 @@ namespace Sibelia
 			{
 				uint64_t left = min(front_.GetIndex(), back_.GetIndex());
 				uint64_t right = max(front_.GetIndex(), back_.GetIndex());
-				return it.GetIndex() >= left && it.GetIndex() <= right;
+				return it.GetChrId() == front_.GetChrId() && it.GetIndex() >= left && it.GetIndex() <= right;
 			}
 
 			bool operator < (const Instance & inst) const
@@ -175,7 +179,8 @@ namespace Sibelia
 			}
 		};
 
-		typedef std::multiset<Instance> InstanceSet;
+		typedef FlatMultiset<Instance> InstanceSet;
+		typedef std::vector<InstanceSet::iterator, ArenaAllocator<InstanceSet::iterator> > InstanceList;
 
 		struct Point
 		{
@@ -217,12 +222,12 @@ namespace Sibelia
 			return origin_;
 		}
 
-		const std::vector<InstanceSet> & Instances() const
+		const InstanceSet & Instances() const
 		{
 			return instance_;
 		}
 
-		const std::vector<InstanceSet::iterator> & AllInstances() const
+		const InstanceList & AllInstances() const
 		{
 			return allInstance_;
 		}
@@ -339,24 +344,19 @@ namespace Sibelia
 
 		void DumpInstances(std::ostream & out) const
 		{
-			size_t total = 0;
-			for (auto & instanceSet : instance_)
+			for (auto inst : instance_)
 			{
-				total += instanceSet.size();
-				for (auto inst : instanceSet)
-				{
-					int64_t middlePath = MiddlePathLength();
-					int64_t length = inst.UtilityLength();
-
-					int64_t start = inst.Front().GetPosition();
-					int64_t end = inst.Back().GetPosition();
-					out << "(" << (inst.Front().IsPositiveStrand() ? '+' : '-') <<
-						inst.Front().GetChrId() << ' ' << start << ' ' << end << ' ' << end - start << ';' <<
-						inst.LeftFlankDistance() << ' ' << inst.RightFlankDistance() << ')' << std::endl;
-				}
+				int64_t middlePath = MiddlePathLength();
+				int64_t length = inst.UtilityLength();
+
+				int64_t start = inst.Front().GetPosition();
+				int64_t end = inst.Back().GetPosition();
+				out << "(" << (inst.Front().IsPositiveStrand() ? '+' : '-') <<
+					inst.Front().GetChrId() << ' ' << start << ' ' << end << ' ' << end - start << ';' <<
+					inst.LeftFlankDistance() << ' ' << inst.RightFlankDistance() << ')' << std::endl;
 			}
 
-			out << "Total: " << total << std::endl;
+			out << "Total: " << instance_.size() << std::endl;
 		}
 
 		void DumpPath(std::vector<Edge> & ret) const
@@ -375,7 +375,7 @@ namespace Sibelia
 
 		bool Compatible(const JunctionStorage::JunctionSequentialIterator & start, const JunctionStorage::JunctionSequentialIterator & end, const Edge & e) const
 		{
-			if (start.IsPositiveStrand() != end.IsPositiveStrand())
+			if (start.IsPositiveStrand() != end.IsPositiveStrand() || start.GetChrId() != end.GetChrId())
 			{
 				return false;
 			}
@@ -429,12 +429,12 @@ namespace Sibelia
 
 			void operator()() const
 			{
-				for (JunctionStorage::JunctionIterator nowIt(vertex); nowIt.Valid() && !failFlag; nowIt++)
+				for (JunctionStorage::JunctionIterator nowIt(*path->storage_, vertex); nowIt.Valid() && !failFlag; nowIt++)
 				{
 					bool newInstance = true;
 					if (!nowIt.IsUsed())
 					{
-						auto & instanceSet = path->instance_[nowIt.GetChrId()];
+						auto & instanceSet = path->instance_;
 						auto inst = instanceSet.upper_bound(Instance(nowIt.SequentialIterator(), 0));
 						if (inst != instanceSet.end() && inst->Within(nowIt))
 						{
@@ -491,12 +491,12 @@ namespace Sibelia
 
 			void operator()() const
 			{
-				for (JunctionStorage::JunctionIterator nowIt(vertex); nowIt.Valid() && !failFlag; nowIt++)
+				for (JunctionStorage::JunctionIterator nowIt(*path->storage_, vertex); nowIt.Valid() && !failFlag; nowIt++)
 				{
 					bool newInstance = true;
 					if (!nowIt.IsUsed())
 					{
-						auto & instanceSet = path->instance_[nowIt.GetChrId()];
+						auto & instanceSet = path->instance_;
 						auto inst = instanceSet.upper_bound(Instance(nowIt.SequentialIterator(), 0));
 						if (inst != instanceSet.end() && inst->Within(nowIt))
 						{
@@ -548,7 +548,7 @@ namespace Sibelia
 			bool failFlag = false;
 			int64_t startVertexDistance = rightBodyFlank_;
 			int64_t endVertexDistance = startVertexDistance + e.GetLength();
-			distanceKeeper_.Set(e.GetEndVertex(), int(endVertexDistance));
+			distanceKeeper_.Set(e.GetEndVertex(), SignedOffset(endVertexDistance));
 			PointPushBackWorker(this, vertex, endVertexDistance, e, failFlag)();
 			rightBody_.push_back(Point(e, startVertexDistance));
 			rightBodyFlank_ = rightBody_.back().EndDistance();
@@ -567,7 +567,7 @@ namespace Sibelia
 			bool failFlag = false;
 			int64_t endVertexDistance = leftBodyFlank_;
 			int64_t startVertexDistance = endVertexDistance - e.GetLength();
-			distanceKeeper_.Set(e.GetStartVertex(), int(startVertexDistance));
+			distanceKeeper_.Set(e.GetStartVertex(), SignedOffset(startVertexDistance));
 			PointPushFrontWorker(this, vertex, startVertexDistance, e, failFlag)();
 			leftBody_.push_back(Point(e, startVertexDistance));
 			leftBodyFlank_ = leftBody_.back().StartDistance();
@@ -611,7 +611,7 @@ namespace Sibelia
 			return Path::Instance::OldComparator(*a, *b);
 		}
 
-		const std::vector<InstanceSet::iterator> & GoodInstancesList() const
+		const InstanceList & GoodInstancesList() const
 		{
 			return goodInstance_;
 		}
@@ -623,40 +623,33 @@ namespace Sibelia
 
 		void Clear()
 		{
-			for (auto pt : leftBody_)
-			{
-				distanceKeeper_.Unset(pt.GetEdge().GetStartVertex());
-			}
-
-			for (auto pt : rightBody_)
-			{
-				distanceKeeper_.Unset(pt.GetEdge().GetEndVertex());
-			}
-
 			leftBody_.clear();
 			rightBody_.clear();
-			distanceKeeper_.Unset(origin_);
-			for (int64_t v1 = -storage_->GetVerticesNumber() + 1; v1 < storage_->GetVerticesNumber(); v1++)
-			{
-				assert(!distanceKeeper_.IsSet(v1));
-			}
-
-			for (auto it : allInstance_)
-			{
-				instance_[it->Front().GetChrId()].erase(it);
-			}
-
+			distanceKeeper_.Clear();
+			instance_.clear();
 			allInstance_.clear();
 			goodInstance_.clear();
 		}
 
-	private:
+		//Clears the path and drops the buffers it took from its arena, so the arena can be released
+		void ClearBuffers()
+		{
+			Clear();
+			PointVector(leftBody_.get_allocator()).swap(leftBody_);
+			PointVector(rightBody_.get_allocator()).swap(rightBody_);
+			InstanceList(allInstance_.get_allocator()).swap(allInstance_);
+			InstanceList(goodInstance_.get_allocator()).swap(goodInstance_);
+		}
 
-		std::vector<Point> leftBody_;
-		std::vector<Point> rightBody_;
-		std::vector<InstanceSet> instance_;
-		std::vector<InstanceSet::iterator> allInstance_;
-		std::vector<InstanceSet::iterator> goodInstance_;
+	private:
+		typedef std::vector<Point, ArenaAllocator<Point> > PointVector;
+
+		PointVector leftBody_;
+		PointVector rightBody_;
+		//Instances of all chromosomes ordered in the concatenated coordinate space of the storage
+		InstanceSet instance_;
+		InstanceList allInstance_;
+		InstanceList goodInstance_;
 
 		int64_t origin_;
 		int64_t minBlockSize_;
@@ -0,0 +1,406 @@
+#ifndef _SEQUENCE_STORAGE_H_
+#define _SEQUENCE_STORAGE_H_
+
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include <dnachar.h>
+#include <streamfastaparser.h>
+
+#include "mappedfile.h"
+#include "packedsequence.h"
+
+namespace Sibelia
+{
+	class SequenceStorage
+	{
+	public:
+		enum Mode
+		{
+			PLAIN,
+			MAPPED,
+			PACKED
+		};
+
+		//Returned for positions outside of a sequence, like the terminator of std::string
+		static const char NO_CHAR = '\0';
+
+		SequenceStorage() : mode_(PLAIN), loaded_(false)
+		{
+
+		}
+
+		//In the MAPPED mode the bases are read straight from the memory-mapped FASTA file
+		//through a line index similar to .fai. Files with irregular line widths cannot be
+		//indexed this way and are copied into memory as in the PLAIN mode
+		void Init(const std::string & fileName, Mode mode)
+		{
+			Clear();
+			mode_ = mode;
+			fileName_ = fileName;
+			requestedMode_ = mode;
+			if (mode_ == MAPPED && !TryMap(fileName))
+			{
+				Clear();
+				mode_ = PLAIN;
+			}
+
+			if (mode_ == PLAIN)
+			{
+				for (TwoPaCo::StreamFastaParser parser(fileName); parser.ReadRecord(); )
+				{
+					std::string sequence;
+					description_.push_back(parser.GetCurrentHeader());
+					for (char ch; parser.GetChar(ch); )
+					{
+						sequence.push_back(ch);
+					}
+
+					plain_.push_back(std::string());
+					plain_.back().swap(sequence);
+				}
+			}
+			else if (mode_ == PACKED)
+			{
+				for (TwoPaCo::StreamFastaParser parser(fileName); parser.ReadRecord(); )
+				{
+					description_.push_back(parser.GetCurrentHeader());
+					packed_.push_back(PackedSequence());
+					for (char ch; parser.GetChar(ch); )
+					{
+						packed_.back().PushBack(ch);
+					}
+
+					packed_.back().ShrinkToFit();
+				}
+			}
+
+			for (size_t chr = 0; chr < description_.size(); chr++)
+			{
+				length_.push_back(mode_ == PLAIN ? plain_[chr].size() : (mode_ == PACKED ? packed_[chr].GetLength() : record_[chr].length));
+			}
+
+			loaded_ = true;
+		}
+
+		//Maps sequences stored in a file one after another without line breaks
+		void InitContiguous(const std::string & fileName, const std::vector<std::string> & description, const std::vector<size_t> & offset, const std::vector<size_t> & length)
+		{
+			Clear();
+			mode_ = requestedMode_ = MAPPED;
+			fileName_ = fileName;
+			if (!file_.Open(fileName))
+			{
+				throw std::runtime_error("Cannot map the file " + fileName);
+			}
+
+			description_ = description;
+			length_ = length;
+			for (size_t chr = 0; chr < description.size(); chr++)
+			{
+				Record record = { offset[chr], length[chr], std::max<size_t>(length[chr], 1), std::max<size_t>(length[chr], 1) };
+				record_.push_back(record);
+			}
+
+			loaded_ = true;
+		}
+
+		//Counts the records of the FASTA file, 0 if it cannot be mapped
+		static size_t CountRecords(const std::string & fileName)
+		{
+			size_t ret = 0;
+			MappedFile file;
+			if (file.Open(fileName) && file.GetSize() > 0)
+			{
+				const char * end = file.GetData() + file.GetSize();
+				for (const char * now = file.GetData(); (now = static_cast<const char*>(memchr(now, '>', end - now))) != 0; now++)
+				{
+					ret++;
+				}
+			}
+
+			return ret;
+		}
+
+		//Checks if a record of the FASTA file can have more than limit bases. A record cannot
+		//have more bases than there are bytes between its header and the next one
+		static bool HasRecordsLongerThan(const std::string & fileName, uint64_t limit)
+		{
+			MappedFile file;
+			if (!file.Open(fileName) || file.GetSize() <= limit)
+			{
+				return false;
+			}
+
+			const char * end = file.GetData() + file.GetSize();
+			for (const char * start = file.GetData(); start < end;)
+			{
+				const char * next = static_cast<const char*>(memchr(start + 1, '>', end - start - 1));
+				next = next == 0 ? end : next;
+				if (uint64_t(next - start) > limit)
+				{
+					return true;
+				}
+
+				start = next;
+			}
+
+			return false;
+		}
+
+		void Advise(int advice) const
+		{
+			file_.Advise(0, file_.GetSize(), advice);
+		}
+
+		//Frees the bases but keeps the descriptions and the lengths of the sequences
+		void Release()
+		{
+			file_.Close();
+			std::vector<std::string>().swap(plain_);
+			std::vector<PackedSequence>().swap(packed_);
+			loaded_ = false;
+		}
+
+		void Reload()
+		{
+			if (!loaded_)
+			{
+				if (mode_ == MAPPED && !record_.empty())
+				{
+					if (!file_.Open(fileName_))
+					{
+						throw std::runtime_error("Cannot map the file " + fileName_);
+					}
+
+					loaded_ = true;
+				}
+				else
+				{
+					Init(fileName_, requestedMode_);
+				}
+			}
+		}
+
+		Mode GetMode() const
+		{
+			return mode_;
+		}
+
+		//Bytes of the bases held in memory, mapped files are not counted
+		size_t GetMemoryUsage() const
+		{
+			size_t ret = 0;
+			for (size_t chr = 0; chr < plain_.size(); chr++)
+			{
+				ret += plain_[chr].capacity();
+			}
+
+			for (size_t chr = 0; chr < packed_.size(); chr++)
+			{
+				ret += packed_[chr].GetMemoryUsage();
+			}
+
+			return ret;
+		}
+
+		size_t GetChrNumber() const
+		{
+			return description_.size();
+		}
+
+		const std::string & GetDescription(size_t chr) const
+		{
+			return description_[chr];
+		}
+
+		size_t GetLength(size_t chr) const
+		{
+			return length_[chr];
+		}
+
+		char GetChar(size_t chr, int64_t pos) const
+		{
+			if (pos < 0 || size_t(pos) >= GetLength(chr))
+			{
+				return NO_CHAR;
+			}
+
+			if (mode_ == PLAIN)
+			{
+				return plain_[chr][pos];
+			}
+
+			if (mode_ == PACKED)
+			{
+				return packed_[chr].GetChar(pos);
+			}
+
+			const Record & record = record_[chr];
+			return Upper(file_.GetData()[record.offset + pos / record.lineBases * record.lineBytes + pos % record.lineBases]);
+		}
+
+		void Extract(size_t chr, size_t start, size_t length, bool reverse, std::string & out) const
+		{
+			if (mode_ == PACKED)
+			{
+				packed_[chr].Extract(start, length, reverse, out);
+				return;
+			}
+
+			out.resize(length);
+			if (!reverse)
+			{
+				if (mode_ == PLAIN)
+				{
+					out.assign(plain_[chr], start, length);
+				}
+				else
+				{
+					for (size_t i = 0; i < length; i++)
+					{
+						out[i] = GetChar(chr, start + i);
+					}
+				}
+			}
+			else
+			{
+				for (size_t i = 0; i < length; i++)
+				{
+					out[i] = TwoPaCo::DnaChar::ReverseChar(GetChar(chr, start + length - i - 1));
+				}
+			}
+		}
+
+	private:
+
+		struct Record
+		{
+			size_t offset;
+			size_t length;
+			size_t lineBases;
+			size_t lineBytes;
+		};
+
+		static char Upper(char ch)
+		{
+			return ch >= 'a' && ch <= 'z' ? ch - ('a' - 'A') : ch;
+		}
+
+		void Clear()
+		{
+			file_.Close();
+			plain_.clear();
+			packed_.clear();
+			record_.clear();
+			length_.clear();
+			description_.clear();
+			loaded_ = false;
+		}
+
+		bool TryMap(const std::string & fileName)
+		{
+			if (!file_.Open(fileName))
+			{
+				return false;
+			}
+
+			const char * data = file_.GetData();
+			const char * end = data + file_.GetSize();
+			for (const char * now = data; now < end;)
+			{
+				if (*now == '\n' || *now == '\r')
+				{
+					++now;
+					continue;
+				}
+
+				if (*now != '>')
+				{
+					return false;
+				}
+
+				const char * eol = static_cast<const char*>(memchr(now, '\n', end - now));
+				const char * next = eol == 0 ? end : eol + 1;
+				const char * header = eol == 0 ? end : eol;
+				if (header > now + 1 && header[-1] == '\r')
+				{
+					--header;
+				}
+
+				Record record = { size_t(next - data), 0, 0, 0 };
+				description_.push_back(std::string(now + 1, header));
+				bool lastLine = false;
+				for (now = next; now < end && *now != '>'; now = next)
+				{
+					eol = static_cast<const char*>(memchr(now, '\n', end - now));
+					next = eol == 0 ? end : eol + 1;
+					const char * lineEnd = eol == 0 ? end : eol;
+					if (lineEnd > now && lineEnd[-1] == '\r')
+					{
+						--lineEnd;
+					}
+
+					size_t bases = lineEnd - now;
+					if (bases == 0)
+					{
+						lastLine = true;
+						continue;
+					}
+
+					for (const char * it = now; it < lineEnd; it++)
+					{
+						if (isspace(static_cast<unsigned char>(*it)))
+						{
+							return false;
+						}
+					}
+
+					if (lastLine || (record.lineBases != 0 && bases > record.lineBases))
+					{
+						return false;
+					}
+
+					if (record.lineBases == 0)
+					{
+						record.lineBases = bases;
+						record.lineBytes = next - now;
+					}
+					else if (bases < record.lineBases || size_t(next - now) != record.lineBytes)
+					{
+						lastLine = true;
+					}
+
+					record.length += bases;
+				}
+
+				if (record.lineBases == 0)
+				{
+					record.lineBases = record.lineBytes = 1;
+				}
+
+				record_.push_back(record);
+			}
+
+			return true;
+		}
+
+		Mode mode_;
+		bool loaded_;
+		Mode requestedMode_;
+		std::string fileName_;
+		MappedFile file_;
+		std::vector<Record> record_;
+		std::vector<size_t> length_;
+		std::vector<std::string> plain_;
+		std::vector<PackedSequence> packed_;
+		std::vector<std::string> description_;
+	};
+}
+
+#endif
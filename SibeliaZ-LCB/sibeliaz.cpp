@@ -1,6 +1,111 @@
+#include <new>
+#include <limits>
+#include <cstddef>
+#include <cstdlib>
+#include <climits>
+#include <unistd.h>
 #include <tclap/CmdLine.h>
 
+#include "tlbcounter.h"
 #include "blocksfinder.h"
+#include "allocationstats.h"
+
+#ifdef _ALLOCATION_STATS_
+//Every replaced form of operator new and delete goes through these two, so whichever
+//pair the compiler picks for an object, it is counted and freed the same way
+static void * CountedAllocate(size_t size, size_t alignment)
+{
+	void * ret = 0;
+	Sibelia::AllocationStats::Clock::time_point start = Sibelia::AllocationStats::Clock::now();
+	if (alignment <= alignof(std::max_align_t))
+	{
+		ret = malloc(size == 0 ? 1 : size);
+	}
+	else if (posix_memalign(&ret, alignment, size == 0 ? 1 : size) != 0)
+	{
+		ret = 0;
+	}
+
+	Sibelia::AllocationStats::Add(start);
+	if (ret == 0)
+	{
+		throw std::bad_alloc();
+	}
+
+	return ret;
+}
+
+static void CountedFree(void * pointer) noexcept
+{
+	Sibelia::AllocationStats::Clock::time_point start = Sibelia::AllocationStats::Clock::now();
+	free(pointer);
+	Sibelia::AllocationStats::Add(start);
+}
+
+void * operator new(size_t size)
+{
+	return CountedAllocate(size, 0);
+}
+
+void * operator new[](size_t size)
+{
+	return CountedAllocate(size, 0);
+}
+
+void operator delete(void * pointer) noexcept
+{
+	CountedFree(pointer);
+}
+
+void operator delete[](void * pointer) noexcept
+{
+	CountedFree(pointer);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void * pointer, size_t) noexcept
+{
+	CountedFree(pointer);
+}
+
+void operator delete[](void * pointer, size_t) noexcept
+{
+	CountedFree(pointer);
+}
+#endif
+
+#ifdef __cpp_aligned_new
+void * operator new(size_t size, std::align_val_t alignment)
+{
+	return CountedAllocate(size, size_t(alignment));
+}
+
+void * operator new[](size_t size, std::align_val_t alignment)
+{
+	return CountedAllocate(size, size_t(alignment));
+}
+
+void operator delete(void * pointer, std::align_val_t) noexcept
+{
+	CountedFree(pointer);
+}
+
+void operator delete[](void * pointer, std::align_val_t) noexcept
+{
+	CountedFree(pointer);
+}
+
+void operator delete(void * pointer, size_t, std::align_val_t) noexcept
+{
+	CountedFree(pointer);
+}
+
+void operator delete[](void * pointer, size_t, std::align_val_t) noexcept
+{
+	CountedFree(pointer);
+}
+#endif
+#endif
 
 size_t Atoi(const char * str)
 {
@@ -34,6 +139,75 @@ public:
 	}
 };
 
+//The default build keeps 32-bit coordinates. Inputs with longer chromosomes are handed
+//over to sibeliaz-lcb-large, which is installed next to it
+void RunLargeChromosomesVariant(char * argv[])
+{
+	char buffer[PATH_MAX];
+	ssize_t length = readlink("/proc/self/exe", buffer, sizeof(buffer) - 1);
+	if (length > 0)
+	{
+		std::string path = std::string(buffer, length) + "-large";
+		std::cout << "The input has chromosomes longer than " << std::numeric_limits<Sibelia::Offset>::max() << " bp, running " << path << std::endl;
+		execv(path.c_str(), argv);
+	}
+
+	throw std::runtime_error("the input has chromosomes longer than 4294967295 bp, which requires sibeliaz-lcb-large");
+}
+
+const int64_t ESTIMATE_SEEDS = 10000;
+const uint64_t ESTIMATE_SAMPLE_JUNCTIONS = uint64_t(1) << 20;
+const uint64_t ESTIMATE_MIN_SAMPLE_LENGTH = uint64_t(1) << 16;
+
+//The runtime is calibrated on the beginning of every sequence, long enough to hold about
+//ESTIMATE_SAMPLE_JUNCTIONS junctions in total
+uint64_t GetSampleLength(const Sibelia::JunctionStorage::InputSize & input)
+{
+	if (input.records == 0 || input.chromosomes == 0)
+	{
+		return ESTIMATE_MIN_SAMPLE_LENGTH;
+	}
+
+	return std::max(ESTIMATE_MIN_SAMPLE_LENGTH, ESTIMATE_SAMPLE_JUNCTIONS * input.bases / (input.records * input.chromosomes));
+}
+
+void PrintSize(const std::string & name, uint64_t size)
+{
+	std::cout << "  " << name << ": " << (size >> 20) << " MB" << std::endl;
+}
+
+void PrintEstimate(const Sibelia::JunctionStorage::InputSize & input, const Sibelia::JunctionStorage::MemoryEstimate & estimate, uint64_t finder, int64_t threads)
+{
+	std::string bound = input.kind == Sibelia::JunctionStorage::InputSize::BOUND ? "at most " : "";
+	std::cout << "Junctions: " << bound << input.records << ", vertices: about " << input.vertices << ", bases: at most " << input.bases << std::endl;
+	std::cout << "Projected memory:" << std::endl;
+	PrintSize("positions", estimate.positions);
+	PrintSize("vertices", estimate.vertices);
+	PrintSize("sequences", estimate.sequences);
+	PrintSize("junction chars", estimate.junctionChars);
+	PrintSize("adjacency", estimate.adjacency);
+	PrintSize("used flags", estimate.usedFlags);
+	PrintSize("lock table", estimate.locks);
+	PrintSize("block search, " + std::to_string(threads) + " threads", finder);
+	PrintSize("peak while building", estimate.build);
+	PrintSize("peak while searching", estimate.GetSearchTotal() + finder);
+}
+
+//Comparing the counts of runs with --huge-pages and with --tlb-stats alone shows what the
+//huge pages save
+void PrintTlbMisses(Sibelia::TlbMissCounter & counter)
+{
+	uint64_t misses;
+	if (counter.Read(misses))
+	{
+		std::cout << "Data TLB misses: " << misses << std::endl;
+	}
+	else
+	{
+		std::cout << "Data TLB misses: not available" << std::endl;
+	}
+}
+
 int main(int argc, char * argv[])
 {
 	OddConstraint constraint;
@@ -82,10 +256,32 @@ int main(int argc, char * argv[])
 			"integer",
 			cmd);
 
+		TCLAP::ValueArg<unsigned int> loopThreshold("",
+			"loop-threshold",
+			"Drop a junction if the same junction occurs less than this many bp before it, which removes the repeats of short loops and tandem repeats, 0 keeps all junctions",
+			false,
+			0,
+			"integer",
+			cmd);
+
+		TCLAP::ValueArg<unsigned int> memory("",
+			"memory",
+			"Memory budget in GB. Sequences are packed, only the junction chars are kept or fewer threads are used to fit into it, 0 means no budget",
+			false,
+			0,
+			"integer",
+			cmd);
+
+		TCLAP::SwitchArg estimate("",
+			"estimate",
+			"Project the memory from the input sizes, time the block search on the beginning of every sequence (or on an index kept out of core) and exit without loading the whole graph. The abundances of the sample are counted on the sample alone",
+			cmd,
+			false);
+
 		TCLAP::ValueArg<std::string> inFileName("",
 			"graph",
-			"Binary file containing the graph",
-			true,
+			"Binary file containing the graph, either written by TwoPaCo or by --compact-graph. It is always a path: pass a named pipe or /dev/stdin to stream the graph from TwoPaCo",
+			false,
 			"de_bruijn.bin",
 			"file name",
 			cmd);
@@ -93,7 +289,7 @@ int main(int argc, char * argv[])
 		TCLAP::ValueArg<std::string> genomesFileName("",
 			"fasta",
 			"FASTA file containing the genomes",
-			true,
+			false,
 			"",
 			"file name",
 			cmd);
@@ -106,6 +302,62 @@ int main(int argc, char * argv[])
 			"directory name",
 			cmd);
 
+		TCLAP::ValueArg<std::string> sequenceMode("",
+			"sequences",
+			"How the genomes are kept in memory: plain (a copy of every sequence), mapped (read from the memory-mapped FASTA file) or packed (2 bits per base)",
+			false,
+			"plain",
+			"plain|mapped|packed",
+			cmd);
+
+		TCLAP::SwitchArg junctionOnly("",
+			"junctionsonly",
+			"Keep only the bases next to the junctions in memory while looking for blocks",
+			cmd,
+			false);
+
+		TCLAP::ValueArg<std::string> saveIndex("",
+			"save-index",
+			"Save the loaded graph and genomes into a snapshot that can be memory-mapped later",
+			false,
+			"",
+			"file name",
+			cmd);
+
+		TCLAP::ValueArg<std::string> loadIndex("",
+			"load-index",
+			"Load the graph and genomes from a snapshot instead of --graph and --fasta",
+			false,
+			"",
+			"file name",
+			cmd);
+
+		TCLAP::SwitchArg outOfCore("",
+			"out-of-core",
+			"Use the graph and the genomes straight from the index given by --load-index, so the system can page them out. The index is built in memory by an earlier run with --save-index. Seeds are taken in batches of consecutive vertices, so the blocks can differ from an in-memory run",
+			cmd,
+			false);
+
+		TCLAP::ValueArg<std::string> compactGraph("",
+			"compact-graph",
+			"Convert the graph into a compact file that can be passed to --graph later and exit",
+			false,
+			"",
+			"file name",
+			cmd);
+
+		TCLAP::SwitchArg hugePages("",
+			"huge-pages",
+			"Back the large arrays of the graph and of the block search with 2 MB pages, either reserved or transparent ones",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg tlbStats("",
+			"tlb-stats",
+			"Count the data TLB misses and print them at the end, which --huge-pages also does",
+			cmd,
+			false);
+
 		TCLAP::SwitchArg noSeq("",
 			"noseq",
 			"Do not output blocks sequences",
@@ -114,27 +366,269 @@ int main(int argc, char * argv[])
 
 
 		cmd.parse(argc, argv);
+		Sibelia::TlbMissCounter tlbCounter;
+		bool reportTlb = hugePages.getValue() || tlbStats.getValue();
+		if (reportTlb)
+		{
+			tlbCounter.Start();
+		}
+
+		Sibelia::HugePages() = hugePages.getValue();
+
+		Sibelia::SequenceStorage::Mode mode = Sibelia::SequenceStorage::PLAIN;
+		if (sequenceMode.getValue() == "mapped")
+		{
+			mode = Sibelia::SequenceStorage::MAPPED;
+		}
+		else if (sequenceMode.getValue() == "packed")
+		{
+			mode = Sibelia::SequenceStorage::PACKED;
+		}
+		else if (sequenceMode.getValue() != "plain")
+		{
+			throw std::runtime_error("unknown sequences mode " + sequenceMode.getValue());
+		}
+
+		if (compactGraph.isSet())
+		{
+			if (!inFileName.isSet())
+			{
+				throw std::runtime_error("--compact-graph requires --graph");
+			}
+
+			std::cout << "Compacting the graph..." << std::endl;
+			Sibelia::JunctionStorage::CompactJunctions(inFileName.getValue(), compactGraph.getValue());
+			return 0;
+		}
+
+		if (!loadIndex.isSet() && (!inFileName.isSet() || !genomesFileName.isSet()))
+		{
+			throw std::runtime_error("either --graph and --fasta or --load-index must be specified");
+		}
+
+		if (outOfCore.getValue() && !loadIndex.isSet())
+		{
+			throw std::runtime_error("--out-of-core requires --load-index, build the index with --save-index first");
+		}
+
+#ifndef _LARGE_CHROMOSOMES_
+		if (loadIndex.isSet() ? Sibelia::JunctionStorage::IndexNeedsLargeChromosomes(loadIndex.getValue()) :
+			Sibelia::SequenceStorage::HasRecordsLongerThan(genomesFileName.getValue(), std::numeric_limits<Sibelia::Offset>::max()))
+		{
+			RunLargeChromosomesVariant(argv);
+		}
+#endif
+
+		bool junctionOnlyMode = junctionOnly.getValue();
+		uint64_t budget = uint64_t(memory.getValue()) * 1000000000;
+		bool strictBudget = true;
+		Sibelia::JunctionStorage::InputSize input = { Sibelia::JunctionStorage::InputSize::UNKNOWN, 0, 0, 0, 0 };
+		if (!loadIndex.isSet())
+		{
+			input = Sibelia::JunctionStorage::MeasureInput(inFileName.getValue(), genomesFileName.getValue());
+		}
 
-		std::cout << "Loading the graph..." << std::endl;
-		Sibelia::JunctionStorage storage(inFileName.getValue(),
-			genomesFileName.getValue(),
-			kvalue.getValue(),
-			threads.getValue(),
-			abundanceThreshold.getValue(),
-			0);
+		if (budget > 0 && !loadIndex.isSet() && input.kind == Sibelia::JunctionStorage::InputSize::UNKNOWN)
+		{
+			std::cout << "Warning: the size of the graph cannot be bounded, the memory budget is not checked" << std::endl;
+			budget = 0;
+		}
+
+		if (budget > 0 && !loadIndex.isSet())
+		{
+			uint64_t peak;
+			Sibelia::SequenceStorage::Mode requestedMode = mode;
+			uint64_t reserve = Sibelia::BlocksFinder::EstimateMemory(input.vertices, input.records, 1);
+			if (!Sibelia::JunctionStorage::FitMemoryBudget(input, budget, reserve, threads.getValue(), mode, junctionOnlyMode, peak))
+			{
+				if (input.kind == Sibelia::JunctionStorage::InputSize::MEASURED)
+				{
+					std::stringstream ss;
+					ss << "the memory budget is too small, the run needs about " << (peak >> 20) << " MB even with packed sequences and --junctionsonly";
+					throw std::runtime_error(ss.str());
+				}
+
+				//The bound takes a junction at every base and is far above any real graph, so
+				//missing it is no reason to stop the run
+				strictBudget = false;
+				std::cout << "Warning: the graph comes from a pipe and may need up to " << (peak >> 20) << " MB, which exceeds the memory budget" << std::endl;
+			}
+
+			if (mode != requestedMode)
+			{
+				std::cout << "Keeping the sequences packed to fit into the memory budget" << std::endl;
+			}
+
+			if (junctionOnlyMode != junctionOnly.getValue())
+			{
+				std::cout << "Keeping only the junction chars to fit into the memory budget" << std::endl;
+			}
+		}
+
+		if (estimate.getValue() && loadIndex.isSet())
+		{
+			input = Sibelia::JunctionStorage::MeasureIndex(loadIndex.getValue());
+		}
+
+		if (estimate.getValue() && input.kind == Sibelia::JunctionStorage::InputSize::UNKNOWN)
+		{
+			std::cout << "The size of the graph cannot be measured, no memory is projected" << std::endl;
+		}
+		else if (estimate.getValue())
+		{
+			PrintEstimate(input,
+				Sibelia::JunctionStorage::EstimateMemory(input, mode, junctionOnlyMode, threads.getValue()),
+				Sibelia::BlocksFinder::EstimateMemory(input.vertices, input.records, threads.getValue()),
+				threads.getValue());
+		}
+
+		//The estimate never loads the whole graph: the runtime is calibrated either on a sample
+		//of every sequence with the genomes mapped, or on an index kept out of core
+		uint64_t sampleLength = 0;
+		bool indexOutOfCore = outOfCore.getValue() || estimate.getValue();
+		tbb::tick_count loadStart = tbb::tick_count::now();
+		if (estimate.getValue() && !loadIndex.isSet())
+		{
+			sampleLength = GetSampleLength(input);
+			std::cout << "Loading the first " << sampleLength << " bp of every sequence..." << std::endl;
+		}
+		else
+		{
+			std::cout << "Loading the graph..." << std::endl;
+		}
+
+		Sibelia::JunctionStorage storage(kvalue.getValue());
+		if (!loadIndex.isSet())
+		{
+			storage.Init(inFileName.getValue(),
+				genomesFileName.getValue(),
+				threads.getValue(),
+				abundanceThreshold.getValue(),
+				loopThreshold.getValue(),
+				sampleLength > 0 ? Sibelia::SequenceStorage::MAPPED : mode,
+				junctionOnlyMode,
+				sampleLength);
+
+			if (saveIndex.isSet() && sampleLength == 0)
+			{
+				std::cout << "Saving the index..." << std::endl;
+				storage.SaveIndex(saveIndex.getValue());
+			}
+		}
+		else
+		{
+			storage.LoadIndex(loadIndex.getValue(),
+				threads.getValue(),
+				abundanceThreshold.getValue(),
+				loopThreshold.getValue(),
+				junctionOnlyMode,
+				indexOutOfCore);
+		}
 
 		std::cout << "Analyzing the graph..." << std::endl;
+		int64_t finderThreads = threads.getValue();
 		Sibelia::BlocksFinder finder(storage, kvalue.getValue());
+		if (budget > 0)
+		{
+			uint64_t used = storage.GetMemoryUsage();
+			uint64_t rest = budget > used ? budget - used : 0;
+			if (strictBudget || finder.GetMemoryUsage(1) <= rest)
+			{
+				finderThreads = finder.FitMemoryBudget(rest, finderThreads);
+			}
+			else
+			{
+				finderThreads = 1;
+				std::cout << "Warning: looking for blocks exceeds the memory budget, using one thread" << std::endl;
+			}
+
+			if (finderThreads < int64_t(threads.getValue()))
+			{
+				std::cout << "Using " << finderThreads << " threads to fit into the memory budget" << std::endl;
+			}
+		}
+
+		double loadTime = (tbb::tick_count::now() - loadStart).seconds();
+#ifdef _ALLOCATION_STATS_
+		Sibelia::AllocationStats allocationStart;
+#endif
 		finder.FindBlocks(minBlockSize.getValue(),
 			maxBranchSize.getValue(),
 			maxBranchSize.getValue(),
 			8,
-			0,
-			threads.getValue(),
+			estimate.getValue() ? ESTIMATE_SEEDS : 0,
+			finderThreads,
 			outDirName.getValue() + "/paths.txt");
 
+#ifdef _ALLOCATION_STATS_
+		Sibelia::AllocationStats allocation = Sibelia::AllocationStats().Since(allocationStart);
+		std::cout << "Allocator calls while looking for blocks: " << allocation.calls << ", " << allocation.nanoseconds * 1e-9 << " s" << std::endl;
+#endif
+
+		if (estimate.getValue())
+		{
+			//The timed seeds stand for the beginning of the real run. The remaining seeds are projected
+			//with the slowest and the fastest batch after the first one, which also starts the threads.
+			//Seeds only get cheaper as blocks cover their junctions, so the range errs high
+			double sampleTime = 0;
+			size_t sampleSeeds = 0;
+			double low = std::numeric_limits<double>::max();
+			double high = 0;
+			const std::vector<std::pair<size_t, double> > & batchTime = finder.GetBatchTimes();
+			for (size_t b = 0; b < batchTime.size(); b++)
+			{
+				sampleSeeds += batchTime[b].first;
+				sampleTime += batchTime[b].second;
+				if ((b > 0 || batchTime.size() == 1) && batchTime[b].first > 0)
+				{
+					low = std::min(low, batchTime[b].second / batchTime[b].first);
+					high = std::max(high, batchTime[b].second / batchTime[b].first);
+				}
+			}
+
+			//The seeds of the whole graph are scaled from the sample by the share of the distinct
+			//vertices it contains. The beginnings of related genomes share most of their vertices,
+			//so the share of the bases would overstate the rest. A graph from a pipe is counted
+			//while it is read, only an unreadable one falls back to the bases
+			size_t seeds = finder.GetSeedsNumber();
+			uint64_t vertices = input.kind == Sibelia::JunctionStorage::InputSize::MEASURED ? input.vertices - 1 : storage.GetStreamVerticesNumber();
+			if (sampleLength > 0 && vertices > 0 && storage.GetSampleVerticesNumber() > 0)
+			{
+				seeds = size_t(double(seeds) * std::max(vertices, uint64_t(storage.GetSampleVerticesNumber())) / storage.GetSampleVerticesNumber());
+			}
+			else if (sampleLength > 0)
+			{
+				uint64_t bases = 0;
+				uint64_t sampled = 0;
+				for (int64_t chr = 0; chr < storage.GetChrNumber(); chr++)
+				{
+					bases += storage.GetChrLength(chr);
+					sampled += std::min(sampleLength, uint64_t(storage.GetChrLength(chr)));
+				}
+
+				seeds = sampled > 0 ? size_t(double(seeds) * bases / sampled) : seeds;
+			}
+
+			size_t rest = seeds > sampleSeeds ? seeds - sampleSeeds : 0;
+			low = high == 0 ? 0 : low;
+			std::cout << (sampleLength > 0 ? "Loading the sample took " : "Loading the graph took ") << loadTime << " s" << std::endl;
+			std::cout << "Looking for blocks from " << seeds << " seeds with " << finderThreads << " threads should take "
+				<< sampleTime + low * rest << " - " << sampleTime + high * rest << " s" << std::endl;
+			PrintSize(sampleLength > 0 ? "heap of the sample" : "heap of the loaded graph", storage.GetMemoryUsage());
+			if (reportTlb)
+			{
+				PrintTlbMisses(tlbCounter);
+			}
+
+			return 0;
+		}
+
 		std::cout << "Generating the output..." << std::endl;
 		finder.GenerateOutput(outDirName.getValue(), !noSeq.getValue());
+		if (reportTlb)
+		{
+			PrintTlbMisses(tlbCounter);
+		}
 	}
 	catch (TCLAP::ArgException & e)
 	{
@@ -0,0 +1,102 @@
+#ifndef _TLB_COUNTER_H_
+#define _TLB_COUNTER_H_
+
+#include <set>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <tbb/mutex.h>
+#include <tbb/task_scheduler_observer.h>
+
+namespace Sibelia
+{
+	//Counts the data TLB misses of the thread calling Start and of every TBB worker that
+	//joins the scheduler afterwards. Each thread gets its own perf event, the counts are
+	//summed when read. Systems without perf events just have no count
+	class TlbMissCounter : public tbb::task_scheduler_observer
+	{
+	public:
+		~TlbMissCounter()
+		{
+			observe(false);
+			for (size_t i = 0; i < fd_.size(); i++)
+			{
+				close(fd_[i]);
+			}
+		}
+
+		bool Start()
+		{
+			if (!OpenForThisThread())
+			{
+				return false;
+			}
+
+			observe(true);
+			return true;
+		}
+
+		bool Read(uint64_t & misses)
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+			misses = 0;
+			for (size_t i = 0; i < fd_.size(); i++)
+			{
+				uint64_t count;
+				if (read(fd_[i], &count, sizeof(count)) != sizeof(count))
+				{
+					return false;
+				}
+
+				misses += count;
+			}
+
+			return !fd_.empty();
+		}
+
+		void on_scheduler_entry(bool /*worker*/)
+		{
+			OpenForThisThread();
+		}
+
+	private:
+		bool OpenForThisThread()
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+			pid_t tid = pid_t(syscall(SYS_gettid));
+			if (thread_.count(tid) > 0)
+			{
+				return true;
+			}
+
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+			if (fd == -1)
+			{
+				return false;
+			}
+
+			fd_.push_back(fd);
+			thread_.insert(tid);
+			return true;
+		}
+
+		tbb::mutex mutex_;
+		std::vector<int> fd_;
+		std::set<pid_t> thread_;
+	};
+}
+
+#endif